@@ -85,6 +85,7 @@ enum asm_abi_magic {
 	ASM_ABI_MAGIC			= 0x41534DU,
 	ASM_INTEGRITY_MAGIC		= 0x444958,
 	ASM_INTEGRITY_TAG		= 0x4F52,
+	ASM_MIRROR_MAGIC		= 0x4D4952,
 };
 
 /*
@@ -103,6 +104,8 @@ enum asm_operation_types
 	ASMOP_CLOSE_DISK,
 	ASMOP_IO32,
 	ASMOP_IO64,
+	ASMOP_EVENTFD,
+	ASMOP_CANCEL,
 	ASM_NUM_OPERATIONS  /* This must always be last */
 };
 
@@ -150,6 +153,16 @@ struct oracleasm_io_v2
 /*50*/
 };
 
+/*
+ * Asynchronous submission.  Instead of ASMOP_IO, a single asm_ioc
+ * may be submitted with an aio read (IOCB_CMD_PREAD) on the instance
+ * file whose buffer is the asm_ioc and whose length is its size.  The
+ * I/O is then reaped with io_getevents() rather than ASMOP_IO: the
+ * event's res is the final status_asm_ioc, and res2 is error_asm_ioc
+ * when ASM_ERROR is set.  The asm_ioc itself is not updated, and
+ * disks with software integrity are not supported this way.
+ */
+
 struct oracleasm_integrity_v2
 {
 	__u32				it_magic;
@@ -164,6 +177,59 @@ enum oracleasm_integrity_handling_flags {
 	ASM_IFLAG_IP_CHECKSUM		= 2,	/* IP checksum instead of CRC */
 };
 
+/*
+ * On ASM_ERR_INTEGRITY, edetail_asm_ioc names the tag that failed and
+ * the offset, in the disk's ASM blocks, of the block holding the
+ * failure from the start of the I/O.
+ * ASM_ITAG_UNKNOWN means the failure could not be pinned to a block
+ * and the whole I/O is suspect.
+ */
+enum oracleasm_integrity_tags {
+	ASM_ITAG_UNKNOWN		= 0,
+	ASM_ITAG_GUARD			= 1,	/* Guard (checksum) tag */
+	ASM_ITAG_APP			= 2,	/* Application tag */
+	ASM_ITAG_REF			= 3,	/* Reference tag */
+};
+#define ASM_EDETAIL_TAG_SHIFT		24
+#define ASM_EDETAIL_OFFSET_MASK		0x00ffffffU
+
+/*
+ * Mirrored I/O.  For ASM_READ_MIRRORED, check_asm_ioc points at an
+ * oracleasm_mirror_v2 naming up to two more copies of the blocks at
+ * disk_asm_ioc and first_asm_ioc.  The driver reads the first copy
+ * and, if it hasn't answered within the hedge percentile of that
+ * disk's recent read latency (the hedge mount option) or it fails,
+ * the next.  The first copy to succeed completes the asm_ioc.  Copies
+ * are read into driver memory and only the winner is copied to the
+ * buffer, so it is free once the asm_ioc is reaped even if slower
+ * copies are still out.  Every copy must be open in this instance with
+ * the same block size and without data integrity, and mirrored I/O
+ * can't be submitted through aio.
+ *
+ * ASM_WRITE_MIRRORED writes the buffer to every copy at once, and
+ * completes once they are all back, so the buffer is free again when
+ * it is reaped.  It succeeds if mr_quorum of them landed (zero means
+ * all).  Either way, edetail_asm_ioc has a bit set for each copy that
+ * failed, bit 0 for disk_asm_ioc, bit 1 for mr_copies[0] and so on,
+ * so a copy needing resync is known even when the write succeeded.
+ */
+#define ASM_MAX_MIRRORS			3	/* Copies, the first included */
+
+struct oracleasm_mirror_copy_v2
+{
+	__u64				mc_disk;	/* Disk handle */
+	__u64				mc_first;	/* First block */
+};
+
+struct oracleasm_mirror_v2
+{
+/*00*/	__u32				mr_magic;	/* ASM_MIRROR_MAGIC */
+	__u16				mr_count;	/* Entries used in mr_copies */
+	__u16				mr_quorum;	/* Writes only, 0 for all */
+/*08*/	struct oracleasm_mirror_copy_v2	mr_copies[ASM_MAX_MIRRORS - 1];
+/*28*/
+};
+
 struct oracleasm_query_disk_v2
 {
 /*00*/	struct oracleasm_abi_info	qd_abi;
@@ -182,14 +248,58 @@ enum oracleasm_feature_integrity {
 	ASM_IMODE_MASK			= 3,	/* Interleaving mode mask */
 	ASM_IFMT_IP_CHECKSUM		= 4,	/* 0: T10 CRC, 1: IP checksum */
 	ASM_INTEGRITY_HANDLE_MASK	= 7,	/* Integrity handle mask */
+	ASM_IFMT_NO_REFTAG		= 8,	/* Ref tag unchecked (Type 3) */
+	ASM_INTEGRITY_IOC_MASK		= 7,	/* Bits it_format must match */
+	ASM_IFMT_SOFTWARE		= 0x20,	/* Checked by the driver, not the device */
 	ASM_INTEGRITY_QDF_MASK		= 0xff, /* Querydisk feature mask */
 };
 
+/*
+ * Which block size a disk is addressed in.  A caller may pass a
+ * policy in the ASM_QDF_BSP bits of qd_feature when querying a disk,
+ * and in the low bits of od_flags when opening it.  Either is only
+ * read when ASM_QDF_BSP_VALID or ASM_ODF_BSP_VALID is set, so older
+ * callers that leave qd_feature or od_flags (once od_pad1) unset get
+ * the module default (the use_logical_block_size parameter) as
+ * before.  The resolved policy is returned in the ASM_QDF_BSP bits
+ * along with ASM_QDF_BSP_VALID.
+ */
+enum oracleasm_block_size_policy {
+	ASM_BSP_DEFAULT			= 0,	/* Module default */
+	ASM_BSP_LOGICAL			= 1,	/* Logical block size */
+	ASM_BSP_PHYSICAL		= 2,	/* Physical block size */
+	ASM_BSP_MASK			= 3,	/* Policy mask */
+};
+#define ASM_QDF_BSP_SHIFT		8	/* Policy bits in qd_feature */
+#define ASM_QDF_BSP_VALID		0x4000	/* Policy bits are set */
+#define ASM_ODF_BSP_VALID		0x0100	/* od_flags carries a policy */
+
+/*
+ * Returned in qd_feature.  Without ASM_QDF_DISCARD an ASM_DISCARD
+ * fails with ASM_ERR_NOTSUPP.  ASM_WRITE_ZEROES always works, but is
+ * only a discard when ASM_QDF_DISCARD_ZEROES is set; otherwise the
+ * driver writes zeroes itself.
+ */
+#define ASM_QDF_DISCARD			0x0400	/* Device can discard */
+#define ASM_QDF_DISCARD_ZEROES		0x0800	/* Discarded blocks read zero */
+
+/*
+ * Also returned in qd_feature.  A write is only durable on a disk
+ * with ASM_QDF_WRITE_CACHE once the cache is flushed, by ASM_FLUSH
+ * or a later write with ASM_IOF_PREFLUSH, or if it was written with
+ * ASM_IOF_FUA.  FUA works everywhere, but without ASM_QDF_FUA the
+ * kernel emulates it with a flush after the write.  Kernels before
+ * 2.6.37 report neither bit, and send both flags as a barrier, which
+ * a device without a cache to flush may fail.
+ */
+#define ASM_QDF_WRITE_CACHE		0x1000	/* Volatile write cache */
+#define ASM_QDF_FUA			0x2000	/* Native FUA writes */
+
 struct oracleasm_open_disk_v2
 {
 /*00*/	struct oracleasm_abi_info	od_abi;
 /*10*/	__u32				od_fd;
-	__u32				od_pad1;
+	__u32				od_flags;	/* ASM_ODF_*, ASM_BSP_* */
 	__u64				od_handle;
 /*20*/	
 };
@@ -201,6 +311,47 @@ struct oracleasm_close_disk_v2
 /*18*/
 };
 
+/*
+ * Completion notification.  An instance file polls readable while
+ * its context has completed I/O waiting to be reaped.  ASMOP_EVENTFD
+ * registers an eventfd that is signalled once per completed request;
+ * an ef_fd of -1 drops it.  Kernels before 2.6.31 can't hold an
+ * eventfd, and fail it with -EOPNOTSUPP.
+ */
+struct oracleasm_eventfd_v2
+{
+/*00*/	struct oracleasm_abi_info	ef_abi;
+/*10*/	__s32				ef_fd;
+	__u32				ef_pad1;	/* Pad to 64bit aligned size */
+/*18*/
+};
+
+/*
+ * Deadlines.  An asm_ioc with ASM_IOF_DEADLINE in flags_asm_ioc
+ * carries, in elaptime_asm_ioc, how many microseconds it may take
+ * from submission.  One that overruns is reaped like any other
+ * completion, with ASM_ERROR set and ASM_ERR_TIMEDOUT; as with
+ * cancellation, its buffer stays in use until the device lets go.
+ * Deadlines can't be used with aio submission.
+ */
+
+/*
+ * Cancellation.  cn_ioc is a submitted asm_ioc that has not yet been
+ * reaped.  On success it comes back at once, freed, with ASM_CANCELLED
+ * and ASM_ERROR set and ASM_ERR_CANCELLED, and will not be reaped
+ * again.  A request that already reached the device is only orphaned:
+ * its buffer stays in use until the device lets go of it, so a
+ * cancelled read may still land there.  A discard or write-zeroes
+ * stops before its next chunk.  -EALREADY means it completed first;
+ * reap it as usual.
+ */
+struct oracleasm_cancel_v2
+{
+/*00*/	struct oracleasm_abi_info	cn_abi;
+/*10*/	__u64				cn_ioc;		/* asm_ioc * */
+/*18*/
+};
+
 struct oracleasm_get_iid_v2
 {
 /*00*/	struct oracleasm_abi_info	gi_abi;
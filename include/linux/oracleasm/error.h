@@ -83,6 +83,9 @@ enum _ASMErrors
     ASM_ERR_DSCVR       = 4,    /* Bad discovery string */
     ASM_ERR_NODEV       = 5,    /* Invalid device */
     ASM_ERR_INTEGRITY	= 6,	/* Data integrity error */
+    ASM_ERR_TIMEDOUT	= 7,	/* I/O missed its deadline */
+    ASM_ERR_NOTSUPP	= 8,	/* Operation not supported by the device */
+    ASM_ERR_CANCELLED	= 9,	/* Request was cancelled */
 };
 
 #endif  /* _ORACLEASM_ERROR_H */
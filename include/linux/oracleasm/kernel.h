@@ -62,6 +62,20 @@
 #define ASM_BAD_DATA     0x0200 /* I/O was not allowed by the fence key */
 #define ASM_LOCAL_ERROR  0x0400 /* error is local to this host */
 
+/* i/o flags (flags_asm_ioc) */
+#define ASM_IOF_DEADLINE 0x0001 /* elaptime_asm_ioc is a deadline in usecs */
+#define ASM_IOF_FUA      0x0002 /* write through any volatile cache */
+#define ASM_IOF_PREFLUSH 0x0004 /* flush the cache before writing */
+
+/* write lifetime hints (hint_asm_ioc), counted but not passed on */
+#define ASM_HINT_LIFE_NOT_SET 0x0       /* no hint */
+#define ASM_HINT_LIFE_NONE    0x1       /* no particular lifetime */
+#define ASM_HINT_LIFE_SHORT   0x2       /* e.g. temp and redo */
+#define ASM_HINT_LIFE_MEDIUM  0x3       /* e.g. undo */
+#define ASM_HINT_LIFE_LONG    0x4       /* e.g. datafiles */
+#define ASM_HINT_LIFE_EXTREME 0x5       /* written once, rarely again */
+#define ASM_HINT_LIFE_MASK    0x7
+
 /* special timeout values */
 #define    ASM_NOWAIT    0x0            /* return as soon as possible */
 #define    ASM_WAIT      0xffffffff     /* never timeout */
@@ -81,6 +95,11 @@
 #define ASM_COPY        0x03    /* copy data from one location to another */
 #define ASM_GETKEY      0x04    /* get value of one or more disk keys */
 #define ASM_SETKEY      0x05    /* set value of one or more disk keys */
+#define ASM_READ_MIRRORED 0x06  /* read whichever copy answers first */
+#define ASM_WRITE_MIRRORED 0x07 /* write every copy of one buffer */
+#define ASM_DISCARD     0x08    /* release blocks; buffer unused */
+#define ASM_WRITE_ZEROES 0x09   /* zero blocks; buffer unused */
+#define ASM_FLUSH       0x0A    /* flush the disk's write cache */
 
 
 
@@ -120,7 +139,7 @@ struct _asm_ioc32 {
 	__u32		abn_offset_asm_ioc;
 	__u32		abn_asm_ioc;
 	__u32		abn_mask_asm_ioc;
-	__u32		spare1_asm_ioc;
+	__u32		edetail_asm_ioc;
 	__u64		tag_asm_ioc;
 	__u64		reserved_asm_ioc;
 	__u32		buffer_asm_ioc;
@@ -151,7 +170,7 @@ struct _asm_ioc64 {
 	__u32		abn_offset_asm_ioc;
 	__u32		abn_asm_ioc;
 	__u32		abn_mask_asm_ioc;
-	__u32		spare1_asm_ioc;
+	__u32		edetail_asm_ioc;
 	__u64		tag_asm_ioc;
 	__u64		reserved_asm_ioc;
 	__u64		buffer_asm_ioc;
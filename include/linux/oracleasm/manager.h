@@ -90,6 +90,18 @@
  */
 #define ASM_MANAGER_INSTANCE_CONNECTION	"instance"
 
+/*
+ * Per-instance I/O statistics, one line per instance, in
+ * <manager>/iid/.stats
+ */
+#define ASM_MANAGER_INSTANCE_STATS	".stats"
+
+/*
+ * Queue depth and latency for each process attached to an instance,
+ * in <manager>/iid/.contexts
+ */
+#define ASM_MANAGER_INSTANCE_CONTEXTS	".contexts"
+
 /*
  * Filenames for the operation transaction files.
  */
@@ -4,6 +4,8 @@
 #include <linux/bio.h>
 
 static void asm_end_bio_io(struct bio *bio, int error);
+static void asm_end_mirror_bio(struct bio *bio, int error);
+static void asm_end_zero_bio(struct bio *bio, int error);
 
 static int old_end_bio_io(struct bio *bio, unsigned int bytes_done,
 			  int error)
@@ -16,4 +18,26 @@ static int old_end_bio_io(struct bio *bio, unsigned int bytes_done,
 }
 #define kapi_asm_end_bio_io old_end_bio_io
 
+static int old_end_mirror_bio(struct bio *bio, unsigned int bytes_done,
+			      int error)
+{
+	if (bio->bi_size)
+		return 1;
+
+	asm_end_mirror_bio(bio, error);
+	return 0;
+}
+#define kapi_asm_end_mirror_bio old_end_mirror_bio
+
+static int old_end_zero_bio(struct bio *bio, unsigned int bytes_done,
+			    int error)
+{
+	if (bio->bi_size)
+		return 1;
+
+	asm_end_zero_bio(bio, error);
+	return 0;
+}
+#define kapi_asm_end_zero_bio old_end_zero_bio
+
 #endif
@@ -0,0 +1,172 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * NAME
+ *	asm_trace.h - Tracepoints for the ASM request lifecycle.
+ *
+ * Copyright (c) 2013 Oracle Corporation.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * A request is identified by its key, the value handed back to
+ * userspace in reserved_asm_ioc.  Following one key from
+ * oracleasm_submit to oracleasm_reap gives queue, device and reap
+ * time; the bio events line up with the block layer's own.
+ */
+
+#ifndef ASM_TRACE_EVENTS
+
+#ifndef _ASM_TRACE_H
+#define _ASM_TRACE_H
+
+#define trace_oracleasm_submit(key, dev, sector, bytes, op)	do { } while (0)
+#define trace_oracleasm_bio_dispatch(key, bio, rw)		do { } while (0)
+#define trace_oracleasm_bio_complete(key, bio, error)		do { } while (0)
+#define trace_oracleasm_request_complete(key, dev, status, error, elapsed) \
+	do { } while (0)
+#define trace_oracleasm_reap(key, status, error, elapsed)	do { } while (0)
+
+#endif  /* _ASM_TRACE_H */
+
+#else  /* ASM_TRACE_EVENTS */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM oracleasm
+
+#if !defined(_ASM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ASM_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/bio.h>
+
+TRACE_EVENT(oracleasm_submit,
+	TP_PROTO(u64 key, dev_t dev, sector_t sector, size_t bytes, u8 op),
+	TP_ARGS(key, dev, sector, bytes, op),
+	TP_STRUCT__entry(
+		__field(u64,		key)
+		__field(dev_t,		dev)
+		__field(sector_t,	sector)
+		__field(size_t,		bytes)
+		__field(u8,		op)
+	),
+	TP_fast_assign(
+		__entry->key	= key;
+		__entry->dev	= dev;
+		__entry->sector	= sector;
+		__entry->bytes	= bytes;
+		__entry->op	= op;
+	),
+	TP_printk("key=0x%llx dev=%d,%d sector=%llu bytes=%zu op=%u",
+		  (unsigned long long)__entry->key,
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long long)__entry->sector, __entry->bytes,
+		  __entry->op)
+);
+
+TRACE_EVENT(oracleasm_bio_dispatch,
+	TP_PROTO(u64 key, struct bio *bio, int rw),
+	TP_ARGS(key, bio, rw),
+	TP_STRUCT__entry(
+		__field(u64,		key)
+		__field(void *,		bio)
+		__field(dev_t,		dev)
+		__field(sector_t,	sector)
+		__field(unsigned int,	bytes)
+		__field(int,		rw)
+	),
+	TP_fast_assign(
+		__entry->key	= key;
+		__entry->bio	= bio;
+		__entry->dev	= bio->bi_bdev->bd_dev;
+		__entry->sector	= bio->bi_sector;
+		__entry->bytes	= bio->bi_size;
+		__entry->rw	= rw;
+	),
+	TP_printk("key=0x%llx bio=%p dev=%d,%d sector=%llu bytes=%u rw=%d",
+		  (unsigned long long)__entry->key, __entry->bio,
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long long)__entry->sector, __entry->bytes,
+		  __entry->rw)
+);
+
+TRACE_EVENT(oracleasm_bio_complete,
+	TP_PROTO(u64 key, struct bio *bio, int error),
+	TP_ARGS(key, bio, error),
+	TP_STRUCT__entry(
+		__field(u64,		key)
+		__field(void *,		bio)
+		__field(int,		error)
+	),
+	TP_fast_assign(
+		__entry->key	= key;
+		__entry->bio	= bio;
+		__entry->error	= error;
+	),
+	TP_printk("key=0x%llx bio=%p error=%d",
+		  (unsigned long long)__entry->key, __entry->bio,
+		  __entry->error)
+);
+
+TRACE_EVENT(oracleasm_request_complete,
+	TP_PROTO(u64 key, dev_t dev, u16 status, int error,
+		 unsigned long elapsed),
+	TP_ARGS(key, dev, status, error, elapsed),
+	TP_STRUCT__entry(
+		__field(u64,		key)
+		__field(dev_t,		dev)
+		__field(u16,		status)
+		__field(int,		error)
+		__field(unsigned long,	elapsed)
+	),
+	TP_fast_assign(
+		__entry->key	= key;
+		__entry->dev	= dev;
+		__entry->status	= status;
+		__entry->error	= error;
+		__entry->elapsed = elapsed;
+	),
+	TP_printk("key=0x%llx dev=%d,%d status=0x%x error=%d elapsed=%luus",
+		  (unsigned long long)__entry->key,
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->status, __entry->error, __entry->elapsed)
+);
+
+TRACE_EVENT(oracleasm_reap,
+	TP_PROTO(u64 key, u16 status, int error, unsigned long elapsed),
+	TP_ARGS(key, status, error, elapsed),
+	TP_STRUCT__entry(
+		__field(u64,		key)
+		__field(u16,		status)
+		__field(int,		error)
+		__field(unsigned long,	elapsed)
+	),
+	TP_fast_assign(
+		__entry->key	= key;
+		__entry->status	= status;
+		__entry->error	= error;
+		__entry->elapsed = elapsed;
+	),
+	TP_printk("key=0x%llx status=0x%x error=%d elapsed=%luus",
+		  (unsigned long long)__entry->key, __entry->status,
+		  __entry->error, __entry->elapsed)
+);
+
+#endif  /* _ASM_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE asm_trace
+#include <trace/define_trace.h>
+
+#endif  /* ASM_TRACE_EVENTS */
@@ -69,6 +69,18 @@
 #include <linux/parser.h>
 #include <linux/backing-dev.h>
 #include <linux/compat.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/workqueue.h>
+#include <linux/mempool.h>
+#include <linux/percpu_counter.h>
+#include <linux/aio.h>
+#include <linux/poll.h>
+#ifdef EVENTFD_CTX
+#include <linux/eventfd.h>
+#endif
 
 #include <asm/uaccess.h>
 #include <linux/spinlock.h>
@@ -89,8 +101,29 @@
 #include "request.h"
 #include "integrity.h"
 
+#ifdef ASM_TRACE_EVENTS
+#define CREATE_TRACE_POINTS
+#endif
+#include "asm_trace.h"
+
 #include "../kapi-compat/include/blkdev_get_put.h"
 
+/*
+ * struct eventfd_ctx, and a way to hold one from a descriptor, arrived
+ * in 2.6.31.  Before that ASMOP_EVENTFD fails, and there is only poll().
+ */
+#ifndef EVENTFD_CTX
+struct eventfd_ctx;
+# define eventfd_ctx_fdget(_fd)		ERR_PTR(-EOPNOTSUPP)
+# define eventfd_ctx_put(_ctx)		do { } while (0)
+# define eventfd_signal(_ctx, _n)	do { } while (0)
+#endif
+
+/* The sparse annotation came with this_cpu_add(), in 2.6.33 */
+#ifndef __percpu
+# define __percpu
+#endif
+
 #if PAGE_CACHE_SIZE % 1024
 #error Oh no, PAGE_CACHE_SIZE is not divisible by 1k! I cannot cope.
 #endif  /* PAGE_CACHE_SIZE % 1024 */
@@ -125,9 +158,15 @@ static struct inode_operations asmfs_file_inode_operations;
 static struct inode_operations asmfs_disk_dir_inode_operations;
 static struct inode_operations asmfs_iid_dir_inode_operations;
 
+static void asm_throttle_work(struct work_struct *work);
+static void asm_throttle_refill_work(struct work_struct *work);
+static void asm_rate_reset(struct asmfs_sb_info *asb,
+			   struct asmfs_inode_info *aii);
+
 static struct kmem_cache	*asm_request_cachep;
 static struct kmem_cache	*asmfs_inode_cachep;
 static struct kmem_cache	*asmdisk_cachep;
+static struct workqueue_struct	*asm_nobuf_wq;
 #ifndef kapi_kmem_cache_create
 # define kapi_kmem_cache_create kmem_cache_create
 #endif
@@ -135,11 +174,26 @@ static struct kmem_cache	*asmdisk_cachep;
 static bool use_logical_block_size = false;
 module_param(use_logical_block_size, bool, 0644);
 MODULE_PARM_DESC(use_logical_block_size,
-	"Prefer logical block size over physical (Y=logical, N=physical [default])");
+	"Default for disks opened without a block size policy (Y=logical, N=physical [default])");
+
+/*
+ * The block size a disk is addressed in is chosen per disk when it
+ * is first opened.  ASM_BSP_DEFAULT falls back to the module
+ * parameter; anything else is taken as given.
+ */
+static inline unsigned int asm_resolve_bsp(unsigned int policy)
+{
+	if (policy == ASM_BSP_DEFAULT)
+		policy = use_logical_block_size ? ASM_BSP_LOGICAL :
+						  ASM_BSP_PHYSICAL;
+
+	return policy;
+}
 
-static inline unsigned int asm_block_size(struct block_device *bdev)
+static inline unsigned int asm_block_size(struct block_device *bdev,
+					  unsigned int policy)
 {
-	if (use_logical_block_size)
+	if (policy == ASM_BSP_LOGICAL)
 		return bdev_logical_block_size(bdev);
 
 	return bdev_physical_block_size(bdev);
@@ -154,22 +208,108 @@ struct asmfs_sb_info {
 	 * counts. Conceptually, this could probably be a semaphore,
 	 * but the only thing we do while holding the lock is
 	 * arithmetic, so there's no point */
-	spinlock_t asmfs_lock;
-
-	/* It is important that at least the free counts below be
-	   signed.  free_XXX may become negative if a limit is changed
-	   downwards (by a remount) below the current usage. */
+	spinlock_t asmfs_lock;		/* Never taken from interrupts */
 
 	/* max number of inodes - controls # of instances */
 	long max_inodes;
-	/* free_inodes = max_inodes - total number of inodes currently in use */
-	long free_inodes;
+	/*
+	 * Inodes currently in use.  Per-CPU, so that instances coming
+	 * and going don't share a cacheline; it is only summed when
+	 * usage gets close to max_inodes.  May exceed max_inodes if
+	 * the limit is lowered by a remount.
+	 */
+	struct percpu_counter used_inodes;
+
+#ifdef ATOMIC64
+	atomic64_t next_iid;
+#else
+	spinlock_t iid_lock;
+	u64 next_iid;
+#endif
 
-	unsigned long next_iid;
+	/*
+	 * In-flight limits, zero for none.  maxdiskios counts every
+	 * instance's requests to a LUN; see asm_throttle_full().
+	 */
+	int max_disk_ios;
+	int max_instance_ios;
+
+	/* Rate limits per instance, zero for none.  See asm_rate_take() */
+	unsigned int max_iops;
+	u64 max_bps;			/* From maxmbps, in bytes */
+
+	/* Tunables.  See asmfs_apply_tunables() */
+	mempool_t *reqpool;		/* Reserve of requests, or NULL */
+	int reqpool_size;
+	int poll;			/* Spin before sleeping for I/O */
+	unsigned int spin_usecs;	/* ...for this long */
+	unsigned int batch;		/* Completions to wait for at once */
+	int stats;			/* Keep iid/.stats counters */
+	unsigned int close_poll_ms;	/* Close's wait for other processes */
+	unsigned int hedge_pct;		/* Latency percentile to hedge reads at */
+
+	/* Instance files, for iid/.stats.  Protected by asmfs_lock */
+	struct list_head asmfs_instances;
 };
 
 #define ASMFS_SB(sb) ((struct asmfs_sb_info *)((sb)->s_fs_info))
 
+/*
+ * 32-bit architectures only got atomic64_t in 2.6.31.  Before that,
+ * IIDs come from under a lock of their own.
+ */
+#ifdef ATOMIC64
+# define asmfs_iid_init(_asb)	atomic64_set(&(_asb)->next_iid, 1)
+# define asmfs_iid_next(_asb)					\
+	((u64)atomic64_inc_return(&(_asb)->next_iid) - 1)
+# define asmfs_iid_limit(_asb)	((u64)atomic64_read(&(_asb)->next_iid))
+#else
+static inline void asmfs_iid_init(struct asmfs_sb_info *asb)
+{
+	spin_lock_init(&asb->iid_lock);
+	asb->next_iid = 1;
+}
+
+static inline u64 asmfs_iid_next(struct asmfs_sb_info *asb)
+{
+	u64 iid;
+
+	spin_lock(&asb->iid_lock);
+	iid = asb->next_iid++;
+	spin_unlock(&asb->iid_lock);
+
+	return iid;
+}
+
+static inline u64 asmfs_iid_limit(struct asmfs_sb_info *asb)
+{
+	u64 iid;
+
+	spin_lock(&asb->iid_lock);
+	iid = asb->next_iid;
+	spin_unlock(&asb->iid_lock);
+
+	return iid;
+}
+#endif
+
+/*
+ * percpu_counter_compare() arrived in 2.6.35.  Without it, the counter
+ * is summed every time.
+ */
+#ifndef PERCPU_COUNTER_COMPARE
+static inline int percpu_counter_compare(struct percpu_counter *fbc, s64 rhs)
+{
+	s64 count = percpu_counter_sum(fbc);
+
+	if (count > rhs)
+		return 1;
+	if (count < rhs)
+		return -1;
+	return 0;
+}
+#endif
+
 
 struct asmfs_file_info {
 	struct file *f_file;
@@ -178,13 +318,70 @@ struct asmfs_file_info {
 	struct list_head f_ctx;		/* Hook into the i_threads list */
 	struct list_head f_ios;		/* Outstanding I/Os for this thread */
 	struct list_head f_complete;	/* Completed I/Os for this thread */
+	struct list_head f_orphans;	/* Cancelled I/Os still on the device */
+	struct timer_list f_deadline;	/* Next request deadline */
 	struct list_head f_disks;	/* List of disks opened */
 	struct bio *f_bio_free;		/* bios to free */
+
+	struct eventfd_ctx *f_eventfd;	/* Signalled per completion, under f_lock */
+
+	/* aio requests awaiting aio_complete().  Protected by f_lock */
+	struct list_head f_aio_done;
+	struct work_struct f_aio_work;
+
+	/* Throttled requests.  Protected by the inode's i_lock */
+	struct list_head f_held;	/* Requests over the limits */
+	struct list_head f_throttle;	/* Hook into i_throttled */
+	unsigned long f_nr_held;	/* Length of f_held */
+
+	/* For iid/.contexts.  Protected by f_lock */
+	pid_t f_pid;			/* Thread that opened us */
+	char f_comm[TASK_COMM_LEN];
+	unsigned long f_nr_ios;		/* Length of f_ios */
+	unsigned long f_nr_complete;	/* Length of f_complete */
+	unsigned long f_nr_orphans;	/* Handed back, but still on the device */
+	unsigned long f_nr_mirrors;	/* Mirrored I/Os holding their buffers */
+	unsigned long f_nr_bio_free;	/* Length of f_bio_free */
+	u64 f_completed;		/* Requests completed */
+	u64 f_lat_usecs;		/* Summed latency of those requests */
+	unsigned long f_lat_max;	/* Worst latency seen */
 };
 
 #define ASMFS_FILE(_f) ((struct asmfs_file_info *)((_f)->private_data))
 
 
+/*
+ * Per-instance I/O counters.  Each CPU bumps its own copy, from
+ * completion context too; iid/.stats sums them.
+ */
+struct asmfs_instance_stats {
+	u64 is_submitted;		/* Requests taken by asm_submit_io() */
+	u64 is_completed;		/* Requests through asm_finish_io() */
+	u64 is_errors;			/* ...that completed with an error */
+	u64 is_bytes;			/* Bytes moved without error */
+	u64 is_reaps;			/* Requests handed back to userspace */
+	u64 is_reap_calls;		/* I/O calls that asked for completions */
+	u64 is_wait_usecs;		/* Time I/O calls spent waiting and reaping */
+	u64 is_timeouts;		/* I/O calls whose timeout expired */
+	u64 is_cancelled;		/* Requests cancelled by userspace */
+	u64 is_expired;			/* Requests that missed their deadline */
+	u64 is_hedged;			/* Mirrored reads sent to another copy */
+	u64 is_life[ASM_HINT_LIFE_EXTREME];	/* Writes per hint, NONE first */
+};
+
+#define ASMFS_IID_LEN	24
+
+/*
+ * Rate-limit tokens a CPU has taken from its instance's buckets, in
+ * the same units as i_tok_ios and i_tok_bytes.  They are only good
+ * while rc_gen matches the instance's i_rate_gen.
+ */
+struct asm_rate_cache {
+	s64 rc_ios;
+	s64 rc_bytes;
+	unsigned int rc_gen;
+};
+
 /*
  * asmfs inode data in memory
  *
@@ -194,9 +391,44 @@ struct asmfs_inode_info {
 	spinlock_t i_lock;		/* lock on the asmfs_inode_info structure */
 	struct list_head i_disks;	/* List of disk handles */
 	struct list_head i_threads;	/* list of context structures for each calling thread */
+
+	/* Instance files only */
+	struct list_head i_throttled;	/* Contexts with held requests */
+	int i_inflight;			/* Requests counted against the limits */
+	struct work_struct i_dispatch;	/* Dispatches held requests */
+	struct delayed_work i_refill;	/* Same, once tokens come back */
+	s64 i_tok_ios;			/* Token buckets, in 1/HZ units */
+	s64 i_tok_bytes;
+	unsigned long i_tok_stamp;	/* Last refill, in jiffies */
+	struct asm_rate_cache __percpu *i_rate;
+	unsigned int i_rate_gen;	/* Bumped to void the i_rate caches */
+	struct list_head i_instances;	/* Hook into asmfs_instances */
+	struct asmfs_instance_stats __percpu *i_stats;
+	char i_iid[ASMFS_IID_LEN];	/* Our name in the iid directory */
+
 	struct inode vfs_inode;
 };
 
+/*
+ * this_cpu_add() arrived in 2.6.33.  Before it, per_cpu_ptr() only
+ * takes the pointer alloc_percpu() returned, not one into the middle.
+ */
+#ifdef THIS_CPU_OPS
+# define asmfs_stat_cpu_add(_st, _field, _val)				\
+	this_cpu_add((_st)->_field, (_val))
+#else
+# define asmfs_stat_cpu_add(_st, _field, _val) do {			\
+	per_cpu_ptr((_st), get_cpu())->_field += (_val);		\
+	put_cpu();							\
+} while (0)
+#endif
+
+#define asmfs_stat_add(_aii, _field, _val) do {			\
+	if ((_aii)->i_stats &&						\
+	    ASMFS_SB((_aii)->vfs_inode.i_sb)->stats)			\
+		asmfs_stat_cpu_add((_aii)->i_stats, _field, (_val));	\
+} while (0)
+
 static inline struct asmfs_inode_info *ASMFS_I(struct inode *inode)
 {
 	return container_of(inode, struct asmfs_inode_info, vfs_inode);
@@ -210,12 +442,53 @@ static inline struct inode *ASMFS_F2I(struct file *file)
 /*
  * asm disk info
  */
+/* Read latency buckets, by log2 of microseconds */
+#define ASM_LAT_BUCKETS		24
+#define ASM_LAT_WINDOW		4096	/* Age the history past this many */
+#define ASM_LAT_MIN_SAMPLES	64	/* Don't hedge on less than this */
+
+/*
+ * One per block device, shared by every instance's asm_disk_info for
+ * it, so that maxdiskios bounds what all instances together have in
+ * flight to a LUN.
+ */
+struct asm_lun {
+	struct list_head l_hash;	/* On asm_luns */
+	struct block_device *l_bdev;
+	int l_count;			/* Disks pointing here */
+	int l_inflight;			/* Counted against maxdiskios */
+	struct list_head l_waiters;	/* Disks with requests held for it */
+};
+
+/* Protects asm_luns and everything in an asm_lun.  Nests inside i_lock */
+static LIST_HEAD(asm_luns);
+static DEFINE_SPINLOCK(asm_lun_lock);
+
 struct asm_disk_info {
 	struct asmfs_inode_info *d_inode;
 	struct block_device *d_bdev;	/* Block device we I/O to */
-	int d_max_sectors;		/* Maximum sectors per I/O */
 	int d_live;			/* Is the disk alive? */
 	atomic_t d_ios;			/* Count of in-flight I/Os */
+	struct asm_lun *d_lun;		/* Shared in-flight count */
+	struct list_head d_lun_wait;	/* On l_waiters, under asm_lun_lock */
+
+	/*
+	 * Geometry, cached by asm_disk_refresh_geometry() so that
+	 * asm_submit_io() never has to ask the queue.  Kept next to
+	 * d_bdev and d_ios, which the I/O path touches anyway.
+	 */
+	unsigned int d_bsp;		/* Block size policy, ASM_BSP_* */
+	unsigned int d_blksize_bits;	/* log2 of the ASM block size */
+	unsigned int d_max_bytes;	/* Largest I/O the queue takes */
+	u8 d_iprofile;			/* enum asm_integrity_profile */
+	u8 d_iformat;			/* it_format the disk expects */
+	sector_t d_nr_sectors;		/* Capacity in 512-byte sectors */
+	int d_max_sectors;		/* Maximum sectors per I/O */
+
+	/* Recent read latency, for hedging.  See asm_hedge_delay() */
+	atomic_t d_lat[ASM_LAT_BUCKETS];
+	atomic_t d_lat_count;
+
 	struct list_head d_open;	/* List of assocated asm_disk_heads */
 	struct inode vfs_inode;
 };
@@ -258,6 +531,8 @@ static ssize_t asmfs_svc_io32(struct file *file, char *buf, size_t size);
 #if BITS_PER_LONG == 64
 static ssize_t asmfs_svc_io64(struct file *file, char *buf, size_t size);
 #endif
+static ssize_t asmfs_svc_eventfd(struct file *file, char *buf, size_t size);
+static ssize_t asmfs_svc_cancel(struct file *file, char *buf, size_t size);
 
 static struct transaction_context trans_contexts[] = {
 	[ASMOP_QUERY_VERSION]		= {asmfs_svc_query_version},
@@ -270,6 +545,8 @@ static struct transaction_context trans_contexts[] = {
 #if BITS_PER_LONG == 64
 	[ASMOP_IO64]			= {asmfs_svc_io64},
 #endif
+	[ASMOP_EVENTFD]			= {asmfs_svc_eventfd},
+	[ASMOP_CANCEL]			= {asmfs_svc_cancel},
 };
 
 static struct backing_dev_info memory_backing_dev_info = {
@@ -313,6 +590,7 @@ static void init_asmdisk_once(void *foo)
 
 	memset(d, 0, sizeof(*d));
 	INIT_LIST_HEAD(&d->d_open);
+	INIT_LIST_HEAD(&d->d_lun_wait);
 
 	inode_init_once(&d->vfs_inode);
 }
@@ -320,6 +598,50 @@ static void init_asmdisk_once(void *foo)
 # define kapi_init_asmdisk_once init_asmdisk_once
 #endif
 
+static struct asm_lun *asm_lun_get(struct block_device *bdev)
+{
+	struct asm_lun *l, *new;
+
+	new = kmalloc(sizeof(*new), GFP_KERNEL);
+	if (!new)
+		return NULL;
+
+	spin_lock_irq(&asm_lun_lock);
+	list_for_each_entry(l, &asm_luns, l_hash) {
+		if (l->l_bdev == bdev) {
+			l->l_count++;
+			spin_unlock_irq(&asm_lun_lock);
+			kfree(new);
+			return l;
+		}
+	}
+
+	new->l_bdev = bdev;
+	new->l_count = 1;
+	new->l_inflight = 0;
+	INIT_LIST_HEAD(&new->l_waiters);
+	list_add(&new->l_hash, &asm_luns);
+	spin_unlock_irq(&asm_lun_lock);
+
+	return new;
+}
+
+static void asm_lun_put(struct asm_disk_info *d)
+{
+	struct asm_lun *l = d->d_lun;
+
+	spin_lock_irq(&asm_lun_lock);
+	list_del_init(&d->d_lun_wait);
+	if (--l->l_count)
+		l = NULL;
+	else
+		list_del(&l->l_hash);
+	spin_unlock_irq(&asm_lun_lock);
+
+	kfree(l);
+	d->d_lun = NULL;
+}
+
 static void asmdisk_evict_inode(struct inode *inode)
 {
 	struct asm_disk_info *d = ASMDISK_I(inode);
@@ -339,6 +661,9 @@ static void asmdisk_evict_inode(struct inode *inode)
 
 	mlog(ML_DISK, "Clearing disk 0x%p\n", d);
 
+	if (d->d_lun)
+		asm_lun_put(d);
+
 	if (d->d_bdev) {
 		mlog(ML_DISK,
 		     "Releasing disk 0x%p (bdev 0x%p, dev %X)\n",
@@ -477,8 +802,8 @@ static int asmdisk_set(struct inode *inode, void *data)
  */
 
 
-/* Decrements the free inode count and returns true, or returns false
- * if there are no free inodes */
+/* Counts the inode as used, or returns NULL if there are no free
+ * inodes */
 static struct inode *asmfs_alloc_inode(struct super_block *sb)
 {
 	struct asmfs_sb_info *asb = ASMFS_SB(sb);
@@ -489,27 +814,49 @@ static struct inode *asmfs_alloc_inode(struct super_block *sb)
 	if (!aii)
 		return NULL;
 
-	spin_lock_irq(&asb->asmfs_lock);
-	if (!asb->max_inodes || asb->free_inodes > 0) {
-		asb->free_inodes--;
-		spin_unlock_irq(&asb->asmfs_lock);
-	} else {
-		spin_unlock_irq(&asb->asmfs_lock);
+	percpu_counter_inc(&asb->used_inodes);
+	if (asb->max_inodes &&
+	    (percpu_counter_compare(&asb->used_inodes,
+				    asb->max_inodes) > 0)) {
+		percpu_counter_dec(&asb->used_inodes);
 		kmem_cache_free(asmfs_inode_cachep, aii);
 		return NULL;
 	}
 
+	aii->i_stats = NULL;
+	aii->i_iid[0] = '\0';
+	aii->i_inflight = 0;
+	INIT_WORK(&aii->i_dispatch, asm_throttle_work);
+	INIT_DELAYED_WORK(&aii->i_refill, asm_throttle_refill_work);
+	aii->i_rate = NULL;
+	aii->i_tok_ios = aii->i_tok_bytes = 0;
+	aii->i_tok_stamp = jiffies - HZ;	/* Start with a full bucket */
+	aii->i_rate_gen = 0;
+
 	return &aii->vfs_inode;
 }
 
-/* Increments the free inode count */
+/* Gives back the inode's count */
 static void asmfs_destroy_inode(struct inode *inode)
 {
-	spin_lock_irq(&ASMFS_SB(inode->i_sb)->asmfs_lock);
-	ASMFS_SB(inode->i_sb)->free_inodes++;
-	spin_unlock_irq(&ASMFS_SB(inode->i_sb)->asmfs_lock);
+	struct asmfs_sb_info *asb = ASMFS_SB(inode->i_sb);
+	struct asmfs_inode_info *aii = ASMFS_I(inode);
+
+	cancel_work_sync(&aii->i_dispatch);
+	cancel_delayed_work_sync(&aii->i_refill);
+
+	/* Only instance files are on the list, and only we take them off */
+	if (!list_empty(&aii->i_instances)) {
+		spin_lock(&asb->asmfs_lock);
+		list_del_init(&aii->i_instances);
+		spin_unlock(&asb->asmfs_lock);
+	}
+
+	percpu_counter_dec(&asb->used_inodes);
 
-	kmem_cache_free(asmfs_inode_cachep, ASMFS_I(inode));
+	free_percpu(aii->i_stats);
+	free_percpu(aii->i_rate);
+	kmem_cache_free(asmfs_inode_cachep, aii);
 }
 
 static void instance_init_once(void *foo)
@@ -518,6 +865,8 @@ static void instance_init_once(void *foo)
 
 	INIT_LIST_HEAD(&aii->i_disks);
 	INIT_LIST_HEAD(&aii->i_threads);
+	INIT_LIST_HEAD(&aii->i_throttled);
+	INIT_LIST_HEAD(&aii->i_instances);
 	spin_lock_init(&aii->i_lock);
 
 	inode_init_once(&aii->vfs_inode);
@@ -598,6 +947,8 @@ static int asmfs_mknod(struct inode *dir, struct dentry *dentry, int mode, dev_t
  */
 static int asmfs_create(struct inode *dir, struct dentry *dentry, int mode, struct nameidata *nd)
 {
+	struct asmfs_sb_info *asb = ASMFS_SB(dir->i_sb);
+	struct asmfs_inode_info *aii;
 	struct inode *inode;
 
 	if ((mode & S_IFMT) && !S_ISREG(mode))
@@ -609,6 +960,15 @@ static int asmfs_create(struct inode *dir, struct dentry *dentry, int mode, stru
 	if (!inode)
 		return -ENOMEM;
 
+	aii = ASMFS_I(inode);
+	aii->i_stats = alloc_percpu(struct asmfs_instance_stats);
+	aii->i_rate = alloc_percpu(struct asm_rate_cache);
+	if (!aii->i_stats || !aii->i_rate) {
+		iput(inode);
+		return -ENOMEM;
+	}
+	strlcpy(aii->i_iid, dentry->d_name.name, sizeof(aii->i_iid));
+
 	inode->i_ino = (unsigned long)inode;
 	inode->i_mode = mode;
 	inode->i_uid = current_fsuid();
@@ -621,6 +981,10 @@ static int asmfs_create(struct inode *dir, struct dentry *dentry, int mode, stru
 	inode->i_fop = &asmfs_file_operations;
 	inode->i_mapping->backing_dev_info = &memory_backing_dev_info;
 
+	spin_lock(&asb->asmfs_lock);
+	list_add_tail(&aii->i_instances, &asb->asmfs_instances);
+	spin_unlock(&asb->asmfs_lock);
+
 	d_instantiate(dentry, inode);
 
 	/* Extra count - pin the dentry in core */
@@ -631,21 +995,66 @@ static int asmfs_create(struct inode *dir, struct dentry *dentry, int mode, stru
 
 static void asmfs_put_super(struct super_block *sb)
 {
-	kfree(ASMFS_SB(sb));
+	struct asmfs_sb_info *asb = ASMFS_SB(sb);
+
+	if (!asb)
+		return;
+
+	if (asb->reqpool)
+		mempool_destroy(asb->reqpool);
+	percpu_counter_destroy(&asb->used_inodes);
+	kfree(asb);
 }
 
 enum {
 	OPT_MAX_INSTANCES,
+	OPT_MAX_DISK_IOS,
+	OPT_MAX_INSTANCE_IOS,
+	OPT_MAX_IOPS,
+	OPT_MAX_MBPS,
+	OPT_REQPOOL,
+	OPT_POLL,
+	OPT_NOPOLL,
+	OPT_SPIN,
+	OPT_BATCH,
+	OPT_STATS,
+	OPT_NOSTATS,
+	OPT_CLOSEPOLL,
+	OPT_HEDGE,
 	OPT_ERR,
 };
 
 static match_table_t tokens = {
 	{OPT_MAX_INSTANCES, "maxinstances=%d"},
+	{OPT_MAX_DISK_IOS, "maxdiskios=%d"},
+	{OPT_MAX_INSTANCE_IOS, "maxinstanceios=%d"},
+	{OPT_MAX_IOPS, "maxiops=%d"},
+	{OPT_MAX_MBPS, "maxmbps=%d"},
+	{OPT_REQPOOL, "reqpool=%d"},
+	{OPT_POLL, "poll"},
+	{OPT_NOPOLL, "nopoll"},
+	{OPT_SPIN, "spin=%d"},
+	{OPT_BATCH, "batch=%d"},
+	{OPT_STATS, "stats"},
+	{OPT_NOSTATS, "nostats"},
+	{OPT_CLOSEPOLL, "closepoll=%d"},
+	{OPT_HEDGE, "hedge=%d"},
 	{OPT_ERR, NULL},
 };
 
 struct asmfs_params {
 	long inodes;
+	int disk_ios;
+	int instance_ios;
+	int iops;
+	int mbps;
+	int reqpool;
+	int poll;
+	int spin;
+	int batch;
+	int stats;
+	int closepoll;
+	int hedge;
 };
 
 static int parse_options(char * options, struct asmfs_params *p)
@@ -655,6 +1064,17 @@ static int parse_options(char * options, struct asmfs_params *p)
 	int option;
 
 	p->inodes = -1;
+	p->disk_ios = -1;
+	p->instance_ios = -1;
+	p->iops = -1;
+	p->mbps = -1;
+	p->reqpool = -1;
+	p->poll = -1;
+	p->spin = -1;
+	p->batch = -1;
+	p->stats = -1;
+	p->closepoll = -1;
+	p->hedge = -1;
 
 	while ((s = strsep(&options,",")) != NULL) {
 		int token;
@@ -668,6 +1088,85 @@ static int parse_options(char * options, struct asmfs_params *p)
 				p->inodes = option;
 				break;
 
+			case OPT_MAX_DISK_IOS:
+				if (match_int(&args[0], &option) ||
+				    (option < 0))
+					return -EINVAL;
+				p->disk_ios = option;
+				break;
+
+			case OPT_MAX_INSTANCE_IOS:
+				if (match_int(&args[0], &option) ||
+				    (option < 0))
+					return -EINVAL;
+				p->instance_ios = option;
+				break;
+
+			case OPT_MAX_IOPS:
+				if (match_int(&args[0], &option) ||
+				    (option < 0))
+					return -EINVAL;
+				p->iops = option;
+				break;
+
+			case OPT_MAX_MBPS:
+				if (match_int(&args[0], &option) ||
+				    (option < 0))
+					return -EINVAL;
+				p->mbps = option;
+				break;
+
+			case OPT_REQPOOL:
+				if (match_int(&args[0], &option) ||
+				    (option < 0))
+					return -EINVAL;
+				p->reqpool = option;
+				break;
+
+			case OPT_POLL:
+				p->poll = 1;
+				break;
+
+			case OPT_NOPOLL:
+				p->poll = 0;
+				break;
+
+			case OPT_SPIN:
+				if (match_int(&args[0], &option) ||
+				    (option < 0))
+					return -EINVAL;
+				p->spin = option;
+				break;
+
+			case OPT_BATCH:
+				if (match_int(&args[0], &option) ||
+				    (option < 1))
+					return -EINVAL;
+				p->batch = option;
+				break;
+
+			case OPT_STATS:
+				p->stats = 1;
+				break;
+
+			case OPT_NOSTATS:
+				p->stats = 0;
+				break;
+
+			case OPT_CLOSEPOLL:
+				if (match_int(&args[0], &option) ||
+				    (option < 1))
+					return -EINVAL;
+				p->closepoll = option;
+				break;
+
+			case OPT_HEDGE:
+				if (match_int(&args[0], &option) ||
+				    (option < 0) || (option > 100))
+					return -EINVAL;
+				p->hedge = option;
+				break;
+
 			default:
 				return -EINVAL;
 		}
@@ -686,11 +1185,106 @@ static void init_limits(struct asmfs_sb_info *asb, struct asmfs_params *p)
 	if (p->inodes >= 0)
 		asb->max_inodes = p->inodes;
 
-	asb->free_inodes = asb->max_inodes;
+	asb->max_disk_ios = 0;
+	if (p->disk_ios >= 0)
+		asb->max_disk_ios = p->disk_ios;
+
+	asb->max_instance_ios = 0;
+	if (p->instance_ios >= 0)
+		asb->max_instance_ios = p->instance_ios;
+
+	asb->max_iops = 0;
+	if (p->iops >= 0)
+		asb->max_iops = p->iops;
+
+	asb->max_bps = 0;
+	if (p->mbps >= 0)
+		asb->max_bps = (u64)p->mbps << 20;
 
 	return;
 }
 
+/*
+ * The performance tunables.  At mount, unset ones take their
+ * defaults; at remount, they keep their current values.  Only the
+ * request reserve can fail to apply.
+ *
+ *   reqpool=N     keep N requests in reserve for when memory is tight
+ *   poll, nopoll  spin for a completion before sleeping on it
+ *   spin=N        how long to spin, in microseconds
+ *   batch=N       wait for N completions before waking a reaper
+ *   stats, nostats  keep the iid/.stats counters
+ *   closepoll=N   how often, in ms, the last close of a disk looks
+ *                 for I/O from other processes
+ *   hedge=N       try the next copy of a mirrored read once the last
+ *                 is slower than N% of that disk's reads; 0 waits
+ *                 for an error
+ */
+#define ASMFS_DEFAULT_SPIN_USECS	20
+#define ASMFS_DEFAULT_CLOSE_POLL_MS	1000
+#define ASMFS_DEFAULT_HEDGE_PCT		95
+
+static void init_tunables(struct asmfs_sb_info *asb)
+{
+	asb->reqpool = NULL;
+	asb->reqpool_size = 0;
+	asb->poll = 0;
+	asb->spin_usecs = ASMFS_DEFAULT_SPIN_USECS;
+	asb->batch = 1;
+	asb->stats = 1;
+	asb->close_poll_ms = ASMFS_DEFAULT_CLOSE_POLL_MS;
+	asb->hedge_pct = ASMFS_DEFAULT_HEDGE_PCT;
+}
+
+static int asmfs_apply_tunables(struct asmfs_sb_info *asb,
+				struct asmfs_params *p)
+{
+	mempool_t *pool;
+
+	/*
+	 * A pool, once made, lives until unmount; requests in flight
+	 * point at it.  Shrinking to zero keeps a reserve of one.
+	 */
+	if (p->reqpool > 0 && !asb->reqpool) {
+		pool = mempool_create_slab_pool(p->reqpool,
+						asm_request_cachep);
+		if (!pool)
+			return -ENOMEM;
+		asb->reqpool = pool;
+	} else if (p->reqpool >= 0 && asb->reqpool &&
+		   p->reqpool != asb->reqpool_size) {
+		if (mempool_resize(asb->reqpool, max(p->reqpool, 1),
+				   GFP_KERNEL))
+			return -ENOMEM;
+	}
+	if (p->reqpool >= 0)
+		asb->reqpool_size = p->reqpool;
+
+	if (p->poll >= 0)
+		asb->poll = p->poll;
+	if (p->spin >= 0)
+		asb->spin_usecs = p->spin;
+	if (p->batch > 0)
+		asb->batch = p->batch;
+	if (p->stats >= 0)
+		asb->stats = p->stats;
+	if (p->closepoll > 0)
+		asb->close_poll_ms = p->closepoll;
+	if (p->hedge >= 0)
+		asb->hedge_pct = p->hedge;
+
+	return 0;
+}
+
+static void asmfs_print_tunables(struct asmfs_sb_info *asb)
+{
+	printk(KERN_DEBUG "ASM:	reqpool=%d %s spin=%u batch=%u %s closepoll=%u hedge=%u\n",
+	       asb->reqpool_size, asb->poll ? "poll" : "nopoll",
+	       asb->spin_usecs, asb->batch,
+	       asb->stats ? "stats" : "nostats", asb->close_poll_ms,
+	       asb->hedge_pct);
+}
+
 /* reset_limits is called during a remount to change the usage limits.
 
    This will suceed, even if the new limits are lower than current
@@ -698,16 +1292,32 @@ static void init_limits(struct asmfs_sb_info *asb, struct asmfs_params *p)
    until usage falls below the new limit */
 static void reset_limits(struct asmfs_sb_info *asb, struct asmfs_params *p)
 {
-	spin_lock_irq(&asb->asmfs_lock);
+	struct asmfs_inode_info *aii;
 
-	if (p->inodes >= 0) {
-		int used_inodes = asb->max_inodes - asb->free_inodes;
+	spin_lock(&asb->asmfs_lock);
 
+	if (p->inodes >= 0)
 		asb->max_inodes = p->inodes;
-		asb->free_inodes = asb->max_inodes - used_inodes;
+
+	if (p->disk_ios >= 0)
+		asb->max_disk_ios = p->disk_ios;
+	if (p->instance_ios >= 0)
+		asb->max_instance_ios = p->instance_ios;
+	if (p->iops >= 0)
+		asb->max_iops = p->iops;
+	if (p->mbps >= 0)
+		asb->max_bps = (u64)p->mbps << 20;
+
+	/*
+	 * Tokens handed out under the old limits go, and raised limits
+	 * may let held requests go.
+	 */
+	list_for_each_entry(aii, &asb->asmfs_instances, i_instances) {
+		asm_rate_reset(asb, aii);
+		schedule_work(&aii->i_dispatch);
 	}
 
-	spin_unlock_irq(&asb->asmfs_lock);
+	spin_unlock(&asb->asmfs_lock);
 }
 
 static int asmfs_remount(struct super_block * sb, int * flags, char * data)
@@ -718,6 +1328,9 @@ static int asmfs_remount(struct super_block * sb, int * flags, char * data)
 	if (parse_options((char *)data, &params) != 0)
 		return -EINVAL;
 
+	if (asmfs_apply_tunables(asb, &params))
+		return -ENOMEM;
+
 	reset_limits(asb, &params);
 
 	printk(KERN_DEBUG
@@ -725,6 +1338,11 @@ static int asmfs_remount(struct super_block * sb, int * flags, char * data)
 	       data ? (char *)data : "<defaults>" );
 	printk(KERN_DEBUG "ASM:	maxinstances=%ld\n",
 	       asb->max_inodes);
+	printk(KERN_DEBUG "ASM:	maxdiskios=%d maxinstanceios=%d\n",
+	       asb->max_disk_ios, asb->max_instance_ios);
+	printk(KERN_DEBUG "ASM:	maxiops=%u maxmbps=%llu\n",
+	       asb->max_iops, (unsigned long long)(asb->max_bps >> 20));
+	asmfs_print_tunables(asb);
 
 	return 0;
 }
@@ -766,25 +1384,80 @@ static int compute_max_sectors(struct block_device *bdev)
 	return pow_two_sectors;
 }
 
-static int asm_open_disk(struct file *file, struct block_device *bdev)
+/*
+ * Snapshot everything asm_submit_io() needs to validate and build an
+ * I/O.  This runs only at first open, before anyone can submit; later
+ * only the capacity is refreshed (see asm_disk_resized()).
+ */
+static void asm_disk_refresh_geometry(struct asm_disk_info *d)
+{
+	struct block_device *bdev = d->d_bdev;
+	u32 format = asm_integrity_format(bdev);
+
+	d->d_blksize_bits = blksize_bits(asm_block_size(bdev, d->d_bsp));
+	d->d_max_bytes = queue_max_sectors(bdev_get_queue(bdev)) << 9;
+	d->d_max_sectors = compute_max_sectors(bdev);
+	d->d_iprofile = format ? asm_integrity_profile(bdev) : ASM_IPROF_NONE;
+	d->d_iformat = format & ASM_INTEGRITY_IOC_MASK;
+	d->d_nr_sectors = i_size_read(bdev->bd_inode) >> 9;
+
+	mlog(ML_DISK,
+	     "Disk 0x%p (dev %X): bsp = %u, blksize_bits = %u, "
+	     "max_bytes = %u, integrity = %u/%u, nr_sectors = %llu\n",
+	     d, bdev->bd_dev, d->d_bsp, d->d_blksize_bits, d->d_max_bytes,
+	     d->d_iprofile, d->d_iformat,
+	     (unsigned long long)d->d_nr_sectors);
+}
+
+/*
+ * Rereads the capacity, and returns true if the device changed size
+ * behind our back.  Nothing else is refreshed: other submitters read
+ * the rest of the geometry unlocked, and a resize doesn't change it.
+ */
+static int asm_disk_resized(struct asm_disk_info *d)
+{
+	sector_t nr_sectors = i_size_read(d->d_bdev->bd_inode) >> 9;
+
+	if (nr_sectors == d->d_nr_sectors)
+		return 0;
+
+	mlog(ML_DISK|ML_NOTICE,
+	     "Disk 0x%p (dev %X) changed size, nr_sectors = %llu\n",
+	     d, d->d_bdev->bd_dev, (unsigned long long)nr_sectors);
+	d->d_nr_sectors = nr_sectors;
+
+	return 1;
+}
+
+/*
+ * In ASM blocks, before any shift to sectors, so that a huge first
+ * block can't wrap around to a small sector.
+ */
+static inline int asm_disk_in_range(struct asm_disk_info *d,
+				    u64 first, u64 count)
+{
+	u64 maxblock = d->d_nr_sectors >> (d->d_blksize_bits - 9);
+
+	return (first <= maxblock) && (maxblock - first >= count);
+}
+
+static int asm_open_disk(struct file *file, struct block_device *bdev,
+			 unsigned int policy)
 {
 	int ret;
+	unsigned int bsp = asm_resolve_bsp(policy);
 	struct asm_disk_info *d;
 	struct asm_disk_head *h;
 	struct inode *inode = ASMFS_F2I(file);
 	struct inode *disk_inode;
 	struct asmdisk_find_inode_args args;
 
-	mlog_entry("(0x%p, 0x%p)\n", file, bdev);
+	mlog_entry("(0x%p, 0x%p, %u)\n", file, bdev, policy);
 
 	ret = kapi_asm_blkdev_get(bdev, FMODE_WRITE | FMODE_READ, inode->i_sb);
 	if (ret)
 		goto out;
 
-	ret = set_blocksize(bdev, asm_block_size(bdev));
-	if (ret)
-		goto out_get;
-
 	ret = -ENOMEM;
 	h = kmalloc(sizeof(struct asm_disk_head), GFP_KERNEL);
 	if (!h)
@@ -815,9 +1488,26 @@ static int asm_open_disk(struct file *file, struct block_device *bdev)
 				"New disk 0x%p has set bdev 0x%p but we were opening 0x%p\n",
 				d, d->d_bdev, bdev);
 
+		ret = set_blocksize(bdev, asm_block_size(bdev, bsp));
+		if (!ret) {
+			d->d_lun = asm_lun_get(bdev);
+			if (!d->d_lun)
+				ret = -ENOMEM;
+		}
+		if (ret) {
+			/* Our claim is dropped below, not by eviction */
+			d->d_bdev = NULL;
+			unlock_new_inode(disk_inode);
+			iput(disk_inode);
+			goto out_head;
+		}
+
 		disk_inode->i_mapping->backing_dev_info =
 			&memory_backing_dev_info;
-		d->d_max_sectors = compute_max_sectors(bdev);
+		d->d_bsp = bsp;
+		asm_disk_refresh_geometry(d);
+		memset(d->d_lat, 0, sizeof(d->d_lat));
+		atomic_set(&d->d_lat_count, 0);
 		d->d_live = 1;
 
 		mlog(ML_DISK,
@@ -825,11 +1515,34 @@ static int asm_open_disk(struct file *file, struct block_device *bdev)
 		     d, d->d_bdev, d->d_bdev->bd_dev);
 		unlock_new_inode(disk_inode);
 	} else {
+		/*
+		 * Block numbers mean different things under different
+		 * policies, so a later open can't ask for another one.
+		 */
+		if (policy != ASM_BSP_DEFAULT && bsp != d->d_bsp) {
+			mlog(ML_DISK,
+			     "Disk 0x%p (dev %X) is open with policy %u, not %u\n",
+			     d, d->d_bdev->bd_dev, d->d_bsp, bsp);
+			iput(disk_inode);
+			ret = -EINVAL;
+			goto out_head;
+		}
+
+		/* Whatever the policy asked for, the disk keeps its own */
+		ret = set_blocksize(bdev, asm_block_size(bdev, d->d_bsp));
+		if (ret) {
+			iput(disk_inode);
+			goto out_head;
+		}
+
 		/* Already claimed on first open */
 		mlog(ML_DISK,
 		     "Open of disk 0x%p (bdev 0x%p, dev %X)\n",
 		     d, d->d_bdev, d->d_bdev->bd_dev);
 		kapi_asm_blkdev_put(bdev, FMODE_WRITE | FMODE_READ);
+
+		/* ASM reopens after a rescan, so pick up a new size */
+		asm_disk_resized(d);
 	}
 
 	h->h_disk = d;
@@ -937,15 +1650,16 @@ static int asm_close_disk(struct file *file, unsigned long handle)
 
 			blk_run_address_space(bdev->bd_inode->i_mapping);
 			/*
-			 * Timeout of one second.  This is slightly
-			 * subtle.  In this wait, and *only* this wait,
-			 * we are waiting on I/Os that might have been
-			 * initiated by another process.  In that case,
-			 * the other process's afi will be signaled,
-			 * not ours, so the wake_up() never happens
-			 * here and we need the timeout.
+			 * Timeout of closepoll (one second by default).
+			 * This is slightly subtle.  In this wait, and
+			 * *only* this wait, we are waiting on I/Os that
+			 * might have been initiated by another process.
+			 * In that case, the other process's afi will be
+			 * signaled, not ours, so the wake_up() never
+			 * happens here and we need the timeout.
 			 */
-			schedule_timeout(HZ);
+			schedule_timeout(msecs_to_jiffies(
+				ASMFS_SB(inode->i_sb)->close_poll_ms));
 		} while (1);
 		set_task_state(tsk, TASK_RUNNING);
 		remove_wait_queue(&ASMFS_FILE(file)->f_wait, &wait);
@@ -1064,6 +1778,15 @@ static int asm_update_user_ioc(struct file *file, struct asm_request *r)
 
 	/* From here on, ONLY TRUST copy */
 
+	/* Software-generated tuples go out with the final status */
+	if (copy.r_pi &&
+	    ((copy.r_status & (ASM_FREE | ASM_COMPLETED | ASM_ERROR)) ==
+	     (ASM_FREE | ASM_COMPLETED)) &&
+	    asm_integrity_soft_copyout(copy.r_pi)) {
+		copy.r_status |= ASM_ERROR | ASM_LOCAL_ERROR;
+		copy.r_error = ASM_ERR_FAULT;
+	}
+
 	mlog(ML_IOC, "Putting r_status (0x%08X)\n", copy.r_status);
 	if (put_user(copy.r_status, &(ioc->status_asm_ioc))) {
 		ret = -EFAULT;
@@ -1075,6 +1798,17 @@ static int asm_update_user_ioc(struct file *file, struct asm_request *r)
 			ret = -EFAULT;
 			goto out;
 		}
+		if (put_user(copy.r_edetail, &(ioc->edetail_asm_ioc))) {
+			ret = -EFAULT;
+			goto out;
+		}
+	} else if ((copy.r_status & ASM_COMPLETED) &&
+		   (copy.r_op == ASM_WRITE_MIRRORED)) {
+		/* Copies that failed even though the quorum landed */
+		if (put_user(copy.r_edetail, &(ioc->edetail_asm_ioc))) {
+			ret = -EFAULT;
+			goto out;
+		}
 	}
 	if (copy.r_status & ASM_COMPLETED) {
 		if (put_user(copy.r_elapsed, &(ioc->elaptime_asm_ioc))) {
@@ -1113,18 +1847,39 @@ out:
 }  /* asm_update_user_ioc() */
 
 
-static struct asm_request *asm_request_alloc(void)
+static struct asm_request *asm_request_alloc(struct asmfs_sb_info *asb)
 {
 	struct asm_request *r;
+	mempool_t *pool = NULL;
 
+	/*
+	 * Reclaim first, as without a reserve.  Only when that fails
+	 * dip into the reserve, and never block on it: the requests
+	 * that would refill it may be ours, waiting to be reaped.
+	 */
 	r = kmem_cache_alloc(asm_request_cachep, GFP_KERNEL);
+	if (!r && asb->reqpool) {
+		pool = asb->reqpool;
+		r = mempool_alloc(pool, GFP_KERNEL & ~__GFP_WAIT);
+	}
 
 	if (r) {
+		r->r_pool = pool;
 		r->r_status = ASM_SUBMITTED;
 		r->r_error = 0;
+		r->r_edetail = 0;
 		r->r_bio = NULL;
 		r->r_elapsed = 0;
 		r->r_disk = NULL;
+		r->r_pi = NULL;
+		r->r_throttled = 0;
+		r->r_orphan = 0;
+		r->r_deadline = 0;
+		r->r_expired = 0;
+		r->r_mirror = NULL;
+		r->r_op = ASM_NOOP;
+		r->r_iocb = NULL;
+		INIT_LIST_HEAD(&r->r_held);
 	}
 
 	return r;
@@ -1135,173 +1890,1551 @@ static void asm_request_free(struct asm_request *r)
 {
 	/* FIXME: Clean up bh and buffer stuff */
 
-	kmem_cache_free(asm_request_cachep, r);
+	kfree(r->r_pi);
+
+	if (r->r_pool)
+		mempool_free(r, r->r_pool);
+	else
+		kmem_cache_free(asm_request_cachep, r);
 }  /* asm_request_free() */
 
 
-static void asm_finish_io(struct asm_request *r)
+/*
+ * Mirrored I/O.  The user's buffer is mapped once, into the request's
+ * bio, and a clone of that bio is made up front for each other copy,
+ * while it is still pristine.  A write sends them all at once and
+ * completes when they are all back, succeeding if m_quorum of them
+ * landed.
+ *
+ * A read sends one copy into the buffer, and only tries the next when
+ * the hedge timer says it is slow, or when it fails.  At most one copy
+ * reads into the buffer at a time, and the request does not complete
+ * until that copy is back, so nothing lands in the buffer after it is
+ * reaped.  A hedge sent while a copy is in the buffer reads into pages
+ * of its own instead, allocated when it is sent, and if it wins
+ * asm_mirror_work() copies it in once the buffer is free.  A read too
+ * large for one bio of private pages is simply not hedged.
+ *
+ * The throttle counts every copy as a request to its own disk.
+ *
+ * The bios outlive the request, so they belong to the asm_mirror:
+ * once a write completes, the request no longer points at the mapped
+ * bio, and the asm_mirror holds a d_ios count on every disk it names.
+ * m_ref counts the runs of m_work queued or running, and the run that
+ * drops the last one after every bio is back frees it.  Everything but
+ * the bios themselves is under the context's f_lock.
+ */
+#define asm_op_mirrored(_op)	(((_op) == ASM_READ_MIRRORED) ||	\
+				 ((_op) == ASM_WRITE_MIRRORED))
+
+struct asm_mirror {
+	struct asm_request *m_req;	/* Until it completes */
+	struct asmfs_file_info *m_file;
+	struct asm_disk_info *m_disks[ASM_MAX_MIRRORS];
+	struct bio *m_bios[ASM_MAX_MIRRORS];	/* [0] is the request's */
+	struct bio *m_priv[ASM_MAX_MIRRORS];	/* Hedges, over our pages */
+	ktime_t m_start[ASM_MAX_MIRRORS];	/* When sent */
+	size_t m_count;			/* Bytes per copy */
+	int m_nr;			/* Copies */
+	int m_write;
+	int m_quorum;			/* Writes that must land */
+	int m_good;			/* Copies that have succeeded */
+	unsigned int m_failed;		/* Bitmap of copies that have failed */
+	int m_next;			/* Next copy to send, 0 until started */
+	int m_out;			/* Bios on the device */
+	int m_mapped;			/* A read copy is out into the buffer */
+	int m_win;			/* Hedge that won meanwhile + 1 */
+	int m_done;			/* The request has completed */
+	int m_copy;			/* Hedge to copy in + 1 */
+	int m_ref;			/* Runs of m_work queued or running */
+	struct timer_list m_timer;	/* Hedge */
+	struct work_struct m_work;	/* Sends copies, and frees us */
+};
+
+/* What the throttle counts a request as, one per copy */
+static inline int asm_request_ios(struct asm_request *r)
 {
-	struct asm_disk_info *d;
-	struct asmfs_file_info *afi = r->r_file;
-	unsigned long flags;
+	return r->r_mirror ? r->r_mirror->m_nr : 1;
+}
 
-	mlog_bug_on_msg(!afi, "Request 0x%p has no file pointer\n", r);
+static inline struct asm_disk_info *asm_request_disk(struct asm_request *r,
+						     int i)
+{
+	return r->r_mirror ? r->r_mirror->m_disks[i] : r->r_disk;
+}
 
-	mlog_entry("(0x%p)\n", r);
 
-	spin_lock_irqsave(&afi->f_lock, flags);
+/*
+ * Discard, write-zeroes and flush carry no buffer.  The block layer's
+ * helpers for them sleep until done, so they run on asm_nobuf_wq
+ * rather than from submit.  A discard or write-zeroes goes ASM_NOBUF_CHUNK
+ * bytes at a time, and each chunk passes through the throttle as a
+ * request of that size would.
+ */
+#define asm_op_nobuf(_op)	(((_op) == ASM_DISCARD) ||		\
+				 ((_op) == ASM_WRITE_ZEROES) ||		\
+				 ((_op) == ASM_FLUSH))
 
-	if (r->r_bio) {
-		mlog(ML_REQUEST|ML_BIO,
-		     "Moving bio 0x%p from request 0x%p to the free list\n",
-		     r->r_bio, r);
-		r->r_bio->bi_private = afi->f_bio_free;
-		afi->f_bio_free = r->r_bio;
-		r->r_bio = NULL;
-	}
+#define ASM_NOBUF_CHUNK		(16 << 20)
+
+/* What the request is charged each time through the throttle */
+static inline size_t asm_request_bytes(struct asm_request *r)
+{
+	if (asm_op_nobuf(r->r_op))
+		return min_t(size_t, r->r_left, ASM_NOBUF_CHUNK);
+
+	return r->r_count * asm_request_ios(r);
+}
+
+/*
+ * In-flight limits.  maxdiskios bounds how many requests all
+ * instances together have in flight to one LUN, maxinstanceios how
+ * many one instance has in flight in all.  Each instance has its own
+ * asm_disk_info for a disk, so the per-LUN count lives in the
+ * asm_lun they share.  A mirrored request counts once per copy,
+ * against each copy's LUN, but is let through an idle instance
+ * however wide it is.  A request over either limit is held on its
+ * context's f_held list rather than failed.  Contexts with held
+ * requests sit on i_throttled, and asm_throttle_dispatch() takes one
+ * request from each in turn as slots free up, so a busy process
+ * cannot crowd out the others.  A disk whose LUN is full waits on
+ * l_waiters, so that a completion in any instance wakes its
+ * dispatcher.  Everything here is under the instance's i_lock and
+ * asm_lun_lock.
+ */
+static inline int asm_throttle_full(struct asmfs_sb_info *asb,
+				    struct asmfs_inode_info *aii,
+				    struct asm_request *r)
+{
+	struct asm_disk_info *d;
+	int i, nr = asm_request_ios(r);
+
+	if (asb->max_instance_ios && aii->i_inflight &&
+	    (aii->i_inflight + nr > asb->max_instance_ios))
+		return 1;
+
+	for (i = 0; asb->max_disk_ios && (i < nr); i++) {
+		d = asm_request_disk(r, i);
+		if (d->d_lun->l_inflight >= asb->max_disk_ios) {
+			if (list_empty(&d->d_lun_wait))
+				list_add_tail(&d->d_lun_wait,
+					      &d->d_lun->l_waiters);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Rate limits.  maxiops and maxmbps give each instance a pair of
+ * token buckets.  Tokens are counted in 1/HZ units so that a refill
+ * of rate * jiffies is exact, and a bucket holds at most a tenth of a
+ * second's worth.  A request is let through while its buckets are
+ * positive and is then charged in full, so an I/O larger than the
+ * bucket still goes, and the debt is paid off before the next one.
+ */
+#define ASM_RATE_BURST(_rate)	((s64)(_rate) * HZ / 10)
+#define ASM_RATE_BATCH(_rate)	((s64)(_rate) * HZ / 100)
+
+/*
+ * Most a CPU may keep for itself.  Capped at its share of the burst,
+ * so that the caches together never hold more than one bucket's
+ * worth however many CPUs there are.
+ */
+static inline s64 asm_rate_batch(u64 rate)
+{
+	return min_t(s64, ASM_RATE_BATCH(rate),
+		     div_s64(ASM_RATE_BURST(rate), num_possible_cpus()));
+}
+
+static inline int asm_rate_limited(struct asmfs_sb_info *asb)
+{
+	return asb->max_iops || asb->max_bps;
+}
+
+/* Must be called with i_lock held */
+static void asm_rate_refill(struct asmfs_sb_info *asb,
+			    struct asmfs_inode_info *aii)
+{
+	unsigned long now = jiffies;
+	unsigned long delta = now - aii->i_tok_stamp;
+
+	if (!delta)
+		return;
+	aii->i_tok_stamp = now;
+	if (delta > HZ)
+		delta = HZ;
+
+	if (asb->max_iops)
+		aii->i_tok_ios = min_t(s64,
+				       aii->i_tok_ios +
+				       (s64)asb->max_iops * delta,
+				       ASM_RATE_BURST(asb->max_iops));
+	if (asb->max_bps)
+		aii->i_tok_bytes = min_t(s64,
+					 aii->i_tok_bytes +
+					 (s64)asb->max_bps * delta,
+					 ASM_RATE_BURST(asb->max_bps));
+}
+
+/* Must be called with i_lock held */
+static int asm_rate_admit(struct asmfs_sb_info *asb,
+			  struct asmfs_inode_info *aii, int ios, size_t bytes)
+{
+	if ((asb->max_iops && (aii->i_tok_ios <= 0)) ||
+	    (asb->max_bps && (aii->i_tok_bytes <= 0)))
+		return 0;
+
+	if (asb->max_iops)
+		aii->i_tok_ios -= (s64)ios * HZ;
+	if (asb->max_bps)
+		aii->i_tok_bytes -= (s64)bytes * HZ;
+
+	return 1;
+}
+
+/* Must be called with i_lock held */
+static inline s64 asm_rate_grab(s64 *tokens, s64 want)
+{
+	if ((want <= 0) || (*tokens < want))
+		return 0;
+
+	*tokens -= want;
+	return want;
+}
+
+/*
+ * Called on remount.  The per-CPU caches can't be emptied from here
+ * without racing their owners, so they are voided and each CPU drops
+ * its own on its next submit.  The buckets are trimmed to the new
+ * burst.
+ */
+static void asm_rate_reset(struct asmfs_sb_info *asb,
+			   struct asmfs_inode_info *aii)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&aii->i_lock, flags);
+	aii->i_rate_gen++;
+	aii->i_tok_ios = min_t(s64, aii->i_tok_ios,
+			       ASM_RATE_BURST(asb->max_iops));
+	aii->i_tok_bytes = min_t(s64, aii->i_tok_bytes,
+				 ASM_RATE_BURST(asb->max_bps));
+	spin_unlock_irqrestore(&aii->i_lock, flags);
+}
+
+/*
+ * The submit fast path.  Each CPU keeps up to asm_rate_batch() tokens
+ * of its own, so i_lock is only taken when those run out.
+ * Returns 1 if the request may go now.
+ */
+static int asm_rate_take(struct asmfs_sb_info *asb,
+			 struct asmfs_inode_info *aii, int nr, size_t bytes)
+{
+	struct asm_rate_cache *c;
+	s64 ios = asb->max_iops ? (s64)nr * HZ : 0;
+	s64 nbytes = asb->max_bps ? (s64)bytes * HZ : 0;
+	unsigned int gen = ACCESS_ONCE(aii->i_rate_gen);
+	unsigned long flags;
+	int ret = 1;
+
+	c = per_cpu_ptr(aii->i_rate, get_cpu());
+	if (unlikely(c->rc_gen != gen)) {
+		c->rc_ios = c->rc_bytes = 0;
+		c->rc_gen = gen;
+	}
+	if ((c->rc_ios >= ios) && (c->rc_bytes >= nbytes)) {
+		c->rc_ios -= ios;
+		c->rc_bytes -= nbytes;
+		goto out;
+	}
+
+	spin_lock_irqsave(&aii->i_lock, flags);
+	asm_rate_refill(asb, aii);
+	ret = asm_rate_admit(asb, aii, nr, bytes);
+	if (ret) {
+		c->rc_ios += asm_rate_grab(&aii->i_tok_ios,
+					   asm_rate_batch(asb->max_iops) -
+					   c->rc_ios);
+		c->rc_bytes += asm_rate_grab(&aii->i_tok_bytes,
+					     asm_rate_batch(asb->max_bps) -
+					     c->rc_bytes);
+	}
+	spin_unlock_irqrestore(&aii->i_lock, flags);
+
+out:
+	put_cpu();
+	return ret;
+}
+
+static inline void asm_throttle_account(struct asmfs_inode_info *aii,
+					struct asm_request *r)
+{
+	int i, nr = asm_request_ios(r);
+
+	r->r_throttled = 1;
+	aii->i_inflight += nr;
+	for (i = 0; i < nr; i++)
+		asm_request_disk(r, i)->d_lun->l_inflight++;
+}
+
+static void asm_mirror_start(struct asm_request *r);
+
+static void asm_dispatch_io(struct asm_request *r)
+{
+	if (asm_op_nobuf(r->r_op)) {
+		queue_work(asm_nobuf_wq, &r->r_work);
+		return;
+	}
+
+	if (r->r_mirror) {
+		asm_mirror_start(r);
+		return;
+	}
+
+	mlog(ML_REQUEST|ML_BIO,
+	     "Submitting bio 0x%p for request 0x%p\n", r->r_bio, r);
+	trace_oracleasm_bio_dispatch((u64)(unsigned long)r, r->r_bio,
+				     r->r_rw);
+	r->r_start = ktime_get();
+	submit_bio(r->r_rw, r->r_bio);
+}
+
+static void asm_throttle_dispatch(struct asmfs_inode_info *aii)
+{
+	struct asmfs_sb_info *asb = ASMFS_SB(aii->vfs_inode.i_sb);
+	struct asmfs_file_info *afi, *n;
+	struct asm_request *r, *tmp;
+	LIST_HEAD(ready);
+	int progress, starved = 0;
+
+	spin_lock_irq(&aii->i_lock);
+	spin_lock(&asm_lun_lock);
+	asm_rate_refill(asb, aii);
+	/*
+	 * Each pass gives every waiting context at most one request,
+	 * and the list is rotated between passes so that no context
+	 * always goes first.  Stop once a pass finds nothing that fits,
+	 * or the instance runs out of tokens.
+	 */
+	do {
+		progress = 0;
+		list_for_each_entry_safe(afi, n, &aii->i_throttled,
+					 f_throttle) {
+			list_for_each_entry(r, &afi->f_held, r_held) {
+				if (!asm_throttle_full(asb, aii, r))
+					break;
+			}
+			if (&r->r_held == &afi->f_held)
+				continue;
+			if (!asm_rate_admit(asb, aii, asm_request_ios(r),
+					    asm_request_bytes(r))) {
+				starved = 1;
+				break;
+			}
+
+			list_move_tail(&r->r_held, &ready);
+			afi->f_nr_held--;
+			asm_throttle_account(aii, r);
+			progress = 1;
+
+			if (list_empty(&afi->f_held))
+				list_del_init(&afi->f_throttle);
+		}
+		if (progress && !list_empty(&aii->i_throttled))
+			list_rotate_left(&aii->i_throttled);
+	} while (progress && !starved);
+	spin_unlock(&asm_lun_lock);
+	spin_unlock_irq(&aii->i_lock);
+
+	/* Try again on the next tick, when the buckets have refilled */
+	if (starved)
+		schedule_delayed_work(&aii->i_refill, 1);
+
+	list_for_each_entry_safe(r, tmp, &ready, r_held) {
+		list_del_init(&r->r_held);
+		asm_dispatch_io(r);
+	}
+}
+
+static void asm_throttle_work(struct work_struct *work)
+{
+	struct asmfs_inode_info *aii =
+		container_of(work, struct asmfs_inode_info, i_dispatch);
+
+	asm_throttle_dispatch(aii);
+}
+
+static void asm_throttle_refill_work(struct work_struct *work)
+{
+	struct asmfs_inode_info *aii =
+		container_of(to_delayed_work(work), struct asmfs_inode_info,
+			     i_refill);
+
+	asm_throttle_dispatch(aii);
+}
+
+/* Returns 1 if the request was held, 0 if the caller should submit it */
+static int asm_throttle_io(struct asm_request *r)
+{
+	struct asmfs_file_info *afi = r->r_file;
+	struct asmfs_inode_info *aii = r->r_disk->d_inode;
+	struct asmfs_sb_info *asb = ASMFS_SB(aii->vfs_inode.i_sb);
+	int held = 0;
+
+	if (!asb->max_disk_ios && !asb->max_instance_ios &&
+	    list_empty(&aii->i_throttled)) {
+		if (!asm_rate_limited(asb) ||
+		    asm_rate_take(asb, aii, asm_request_ios(r),
+				  asm_request_bytes(r)))
+			return 0;
+	}
+
+	spin_lock_irq(&aii->i_lock);
+	spin_lock(&asm_lun_lock);
+	asm_rate_refill(asb, aii);
+	/* Don't jump the queue while others are waiting */
+	if (list_empty(&aii->i_throttled) &&
+	    !asm_throttle_full(asb, aii, r) &&
+	    asm_rate_admit(asb, aii, asm_request_ios(r),
+			   asm_request_bytes(r))) {
+		asm_throttle_account(aii, r);
+	} else {
+		mlog(ML_REQUEST, "Holding request 0x%p\n", r);
+		list_add_tail(&r->r_held, &afi->f_held);
+		afi->f_nr_held++;
+		if (list_empty(&afi->f_throttle))
+			list_add_tail(&afi->f_throttle, &aii->i_throttled);
+		held = 1;
+	}
+	spin_unlock(&asm_lun_lock);
+	spin_unlock_irq(&aii->i_lock);
+
+	/* Some other disk may still have room, or we ran out of tokens */
+	if (held)
+		asm_throttle_dispatch(aii);
+
+	return held;
+}
+
+static void asm_throttle_done(struct asm_request *r)
+{
+	struct asmfs_inode_info *aii = r->r_disk->d_inode;
+	struct asm_disk_info *d, *tmp;
+	unsigned long flags;
+	int i, kick, nr = asm_request_ios(r);
+	LIST_HEAD(waiters);
+
+	spin_lock_irqsave(&aii->i_lock, flags);
+	r->r_throttled = 0;
+	aii->i_inflight -= nr;
+	spin_lock(&asm_lun_lock);
+	for (i = 0; i < nr; i++) {
+		d = asm_request_disk(r, i);
+		d->d_lun->l_inflight--;
+		list_splice_init(&d->d_lun->l_waiters, &waiters);
+	}
+	/*
+	 * Wake other instances waiting on these LUNs.  A disk leaves
+	 * l_waiters before it is evicted, and its instance outlives it.
+	 */
+	list_for_each_entry_safe(d, tmp, &waiters, d_lun_wait) {
+		list_del_init(&d->d_lun_wait);
+		if (d->d_inode != aii)
+			schedule_work(&d->d_inode->i_dispatch);
+	}
+	spin_unlock(&asm_lun_lock);
+	kick = !list_empty(&aii->i_throttled);
+	spin_unlock_irqrestore(&aii->i_lock, flags);
+
+	/* We may be in interrupt context, so submit from process context */
+	if (kick)
+		schedule_work(&aii->i_dispatch);
+}
+
+/*
+ * Read latency history, one bucket per power of two microseconds.
+ * Updates race with each other and with aging, which only blurs the
+ * history a little.
+ */
+static void asm_disk_lat_add(struct asm_disk_info *d, unsigned int usecs)
+{
+	int b, total = 0;
+
+	b = usecs ? min_t(int, ilog2(usecs), ASM_LAT_BUCKETS - 1) : 0;
+	atomic_inc(&d->d_lat[b]);
+	if (atomic_inc_return(&d->d_lat_count) < ASM_LAT_WINDOW)
+		return;
+
+	/* Halve it, so that it follows the disk as it changes */
+	for (b = 0; b < ASM_LAT_BUCKETS; b++) {
+		atomic_set(&d->d_lat[b], atomic_read(&d->d_lat[b]) / 2);
+		total += atomic_read(&d->d_lat[b]);
+	}
+	atomic_set(&d->d_lat_count, total);
+}
+
+/*
+ * How long a mirrored read waits on one copy before trying the next:
+ * the hedge percentile of the disk's read latency.  Zero, meaning
+ * only on error, until there is history to go on.
+ */
+static unsigned long asm_hedge_delay(struct asmfs_sb_info *asb,
+				     struct asm_disk_info *d)
+{
+	unsigned int total = atomic_read(&d->d_lat_count);
+	unsigned int want, seen = 0;
+	int b;
+
+	if (!asb->hedge_pct || (total < ASM_LAT_MIN_SAMPLES))
+		return 0;
+
+	want = (total * asb->hedge_pct + 99) / 100;
+	for (b = 0; b < ASM_LAT_BUCKETS - 1; b++) {
+		seen += atomic_read(&d->d_lat[b]);
+		if (seen >= want)
+			break;
+	}
+
+	/*
+	 * The top of the bucket, plus a jiffy: a timer armed for n
+	 * jiffies may fire as soon as n - 1 of them have passed.
+	 */
+	return usecs_to_jiffies(2U << b) + 1;
+}
+
+static inline void asm_disk_io_done(struct asm_disk_info *d)
+{
+	atomic_dec(&d->d_ios);
+	if (atomic_read(&d->d_ios) < 0) {
+		mlog(ML_ERROR,
+		     "d_ios underflow on disk 0x%p (dev %X)\n",
+		     d, d->d_bdev->bd_dev);
+		atomic_set(&d->d_ios, 0);
+	}
+}
+
+/* Frees a mirror set that was never started.  Safe under f_lock. */
+static void asm_mirror_free(struct asm_mirror *m)
+{
+	int i;
+
+	for (i = 0; i < m->m_nr; i++) {
+		if (i)
+			bio_put(m->m_bios[i]);
+		asm_disk_io_done(m->m_disks[i]);
+	}
+	kfree(m);
+}
+
+/*
+ * The part of asm_finish_io() done under f_lock.  Returns the disk
+ * whose d_ios the caller must drop.  An orphan is only detached here;
+ * the caller frees it.
+ */
+static struct asm_disk_info *__asm_finish_io(struct asmfs_file_info *afi,
+					     struct asm_request *r)
+{
+	struct asm_disk_info *d;
+	struct asmfs_inode_info *aii;
+
+	/* An aio request's bio is unmapped by asm_aio_work() */
+	if (r->r_bio && !r->r_iocb) {
+		mlog(ML_REQUEST|ML_BIO,
+		     "Moving bio 0x%p from request 0x%p to the free list\n",
+		     r->r_bio, r);
+		r->r_bio->bi_private = afi->f_bio_free;
+		afi->f_bio_free = r->r_bio;
+		afi->f_nr_bio_free++;
+		r->r_bio = NULL;
+	}
+
+	/* Held until it was cancelled or expired; once sent it frees itself */
+	if (r->r_mirror && !r->r_mirror->m_next)
+		asm_mirror_free(r->r_mirror);
+	r->r_mirror = NULL;
 
 	d = r->r_disk;
 	r->r_disk = NULL;
 
-	list_del(&r->r_list);
-	list_add(&r->r_list, &afi->f_complete);
+	/* Cancelled, and already handed back; just let go of it */
+	if (r->r_orphan) {
+		mlog(ML_REQUEST, "Retiring orphaned request 0x%p\n", r);
+		list_del(&r->r_list);
+		afi->f_nr_orphans--;
+		return d;
+	}
+
+	/*
+	 * Once on f_complete the request can be reaped and freed, so
+	 * everything about it must be settled first.
+	 */
+	r->r_elapsed = ((jiffies - r->r_elapsed) * 1000000) / HZ;
 	if (r->r_error)
 		r->r_status |= ASM_ERROR;
 	r->r_status |= ASM_COMPLETED;
 
+	afi->f_completed++;
+	afi->f_lat_usecs += r->r_elapsed;
+	if (r->r_elapsed > afi->f_lat_max)
+		afi->f_lat_max = r->r_elapsed;
+
+	aii = ASMFS_I(ASMFS_F2I(afi->f_file));
+	asmfs_stat_add(aii, is_completed, 1);
+	if (r->r_error)
+		asmfs_stat_add(aii, is_errors, 1);
+	else if (r->r_op != ASM_DISCARD)
+		asmfs_stat_add(aii, is_bytes, r->r_count);
+
+	trace_oracleasm_request_complete((u64)(unsigned long)r,
+					 d ? d->d_bdev->bd_dev : 0,
+					 r->r_status, r->r_error,
+					 r->r_elapsed);
+
+	if (r->r_expired) {
+		/*
+		 * Past its deadline but not yet reaped, so it is
+		 * already on f_complete.  The reaper gets the real
+		 * result after all.
+		 */
+		r->r_expired = 0;
+		afi->f_nr_orphans--;
+	} else if (r->r_iocb) {
+		/*
+		 * Queued under f_lock: once asm_aio_work() has
+		 * completed the last iocb, the file (and afi) can go.
+		 */
+		list_del(&r->r_list);
+		afi->f_nr_ios--;
+		list_add_tail(&r->r_list, &afi->f_aio_done);
+		schedule_work(&afi->f_aio_work);
+	} else {
+		list_del(&r->r_list);
+		afi->f_nr_ios--;
+		list_add(&r->r_list, &afi->f_complete);
+		afi->f_nr_complete++;
+		if (afi->f_eventfd)
+			eventfd_signal(afi->f_eventfd, 1);
+	}
+
+	return d;
+}
+
+static void asm_finish_io(struct asm_request *r)
+{
+	struct asm_disk_info *d;
+	struct asmfs_file_info *afi = r->r_file;
+	unsigned long flags;
+	int orphan;
+
+	mlog_bug_on_msg(!afi, "Request 0x%p has no file pointer\n", r);
+
+	mlog_entry("(0x%p)\n", r);
+
+	if (r->r_throttled)
+		asm_throttle_done(r);
+
+	spin_lock_irqsave(&afi->f_lock, flags);
+	d = __asm_finish_io(afi, r);
+	orphan = r->r_orphan;
+	/*
+	 * Under f_lock, so that release, which may be waiting for
+	 * this very request, can't free afi under us.
+	 */
+	if (!r->r_iocb)
+		wake_up(&afi->f_wait);
+	spin_unlock_irqrestore(&afi->f_lock, flags);
+
+	if (d)
+		asm_disk_io_done(d);
+
+	mlog(ML_REQUEST, "Finished request 0x%p\n", r);
+
+	if (orphan)
+		asm_request_free(r);
+
+	mlog_exit_void();
+}  /* asm_finish_io() */
+
+
+static void asm_end_ioc(struct asm_request *r, unsigned int bytes_done,
+			int error)
+{
+	mlog_entry("(0x%p, %u, %d)\n", r, bytes_done, error);
+
+	mlog_bug_on_msg(!r, "No request\n");
+
+	mlog_bug_on_msg(!(r->r_status & ASM_SUBMITTED),
+			"Request 0x%p wasn't submitted\n", r);
+
+	mlog(ML_REQUEST,
+	     "Ending request 0x%p, bytes_done = %u, error = %d\n",
+	     r, bytes_done, error);
+	mlog(ML_REQUEST|ML_BIO,
+	     "Ending request 0x%p, bio 0x%p, len = %u\n",
+	     r, r->r_bio,
+	     bytes_done + (r->r_bio ? r->r_bio->bi_size : 0));
+
+	switch (error) {
+		default:
+			mlog(ML_REQUEST|ML_ERROR,
+			     "Invalid error of %d on request 0x%p!\n",
+			     error, r);
+			r->r_error = ASM_ERR_INVAL;
+			r->r_status |= ASM_LOCAL_ERROR;
+			break;
+
+		case 0:
+			break;
+
+		case -EFAULT:
+			r->r_error = ASM_ERR_FAULT;
+			r->r_status |= ASM_LOCAL_ERROR;
+			break;
+
+		case -EIO:
+		case -ENODATA:
+		case -EREMOTEIO:
+			r->r_error = ASM_ERR_IO;
+			break;
+
+		case -EILSEQ:
+			r->r_error = asm_integrity_error(r,
+				r->r_disk ? r->r_disk->d_bdev : NULL,
+				r->r_disk ? r->r_disk->d_iprofile : ASM_IPROF_NONE,
+				r->r_disk ? r->r_disk->d_blksize_bits : 9);
+			break;
+
+		case -ENOLINK:
+		case -EBADE:
+		case -ENODEV:
+			r->r_error = ASM_ERR_NODEV;
+			r->r_status |= ASM_LOCAL_ERROR;
+			break;
+
+		case -ENOMEM:
+			r->r_error = ASM_ERR_NOMEM;
+			r->r_status |= ASM_LOCAL_ERROR;
+			break;
+
+		case -EINVAL:
+			r->r_error = ASM_ERR_INVAL;
+			r->r_status |= ASM_LOCAL_ERROR;
+			break;
+
+		case -EOPNOTSUPP:
+			r->r_error = ASM_ERR_NOTSUPP;
+			break;
+	}
+
+	asm_finish_io(r);
+
+	mlog_exit_void();
+}  /* asm_end_ioc() */
+
+
+/*
+ * Generating the tuples for a software-protected read, or finding
+ * which tuple a device failed, means a pass over all of the data,
+ * which is no job for bio completion.  A request with r_pi only
+ * comes here when its read succeeded, one without only on -EILSEQ.
+ */
+static void asm_end_bio_work(struct work_struct *work)
+{
+	struct asm_request *r =
+		container_of(work, struct asm_request, r_work);
+	int error = 0;
+
+	if (r->r_pi)
+		asm_integrity_soft_complete(r);
+	else
+		error = -EILSEQ;
+
+	asm_end_ioc(r, r->r_count - r->r_bio->bi_size, error);
+}
+
+static void asm_end_bio_io(struct bio *bio, int error)
+{
+	struct asm_request *r;
+
+	mlog_entry("(0x%p, %d)\n", bio, error);
+
+	mlog(ML_BIO, "bio 0x%p, bi_size is %u\n", bio, bio->bi_size);
+
+	r = bio->bi_private;
+
+	trace_oracleasm_bio_complete((u64)(unsigned long)r, bio, error);
+
+	mlog(ML_REQUEST|ML_BIO,
+	     "Completed bio 0x%p for request 0x%p\n", bio, r);
+	if (atomic_dec_and_test(&r->r_bio_count)) {
+		if (!error && (r->r_rw == READ) && r->r_disk)
+			asm_disk_lat_add(r->r_disk,
+					 ktime_us_delta(ktime_get(),
+							r->r_start));
+		if ((!error && r->r_pi) ||
+		    ((error == -EILSEQ) && r->r_bio &&
+		     asm_integrity_mapped(r->r_bio))) {
+			INIT_WORK(&r->r_work, asm_end_bio_work);
+			schedule_work(&r->r_work);
+		} else {
+			asm_end_ioc(r, r->r_count - (r->r_bio ?
+						     r->r_bio->bi_size : 0),
+				    error);
+		}
+	}
+
+	mlog_exit_void();
+}  /* asm_end_bio_io() */
+#ifndef kapi_asm_end_bio_io
+# define kapi_asm_end_bio_io asm_end_bio_io
+#endif
+
+
+/*
+ * Deadlines.  Each context has one timer, set for the earliest
+ * deadline among its outstanding requests.  A request past its
+ * deadline that is still held by the throttle never reached the
+ * device, so it simply fails with ASM_ERR_TIMEDOUT.  One that has
+ * been dispatched moves to f_complete marked r_expired, and is handed
+ * back with ASM_ERR_TIMEDOUT when reaped.  The bio stays with the
+ * device; if it finishes before the reap, the real result goes out
+ * instead, and if not, the reap leaves the request an orphan, as
+ * cancellation does.
+ */
+static void asm_deadline_func(unsigned long data)
+{
+	struct asmfs_file_info *afi = (struct asmfs_file_info *)data;
+	struct asmfs_inode_info *aii = ASMFS_I(ASMFS_F2I(afi->f_file));
+	struct asm_request *r, *n;
+	struct asm_disk_info *d;
+	unsigned long flags, next = 0;
+	int expired = 0;
+
+	/* i_lock first, for f_held */
+	spin_lock_irqsave(&aii->i_lock, flags);
+	spin_lock(&afi->f_lock);
+	list_for_each_entry_safe(r, n, &afi->f_ios, r_list) {
+		if (!r->r_deadline)
+			continue;
+		if (time_before(jiffies, r->r_deadline)) {
+			if (!next || time_before(r->r_deadline, next))
+				next = r->r_deadline;
+			continue;
+		}
+
+		mlog(ML_REQUEST, "Request 0x%p missed its deadline\n", r);
+		expired++;
+
+		if (!list_empty(&r->r_held) && !r->r_throttled) {
+			list_del_init(&r->r_held);
+			afi->f_nr_held--;
+			if (list_empty(&afi->f_held))
+				list_del_init(&afi->f_throttle);
+
+			r->r_error = ASM_ERR_TIMEDOUT;
+			d = __asm_finish_io(afi, r);
+			if (d)
+				asm_disk_io_done(d);
+			continue;
+		}
+
+		r->r_expired = 1;
+		list_move(&r->r_list, &afi->f_complete);
+		afi->f_nr_ios--;
+		afi->f_nr_complete++;
+		afi->f_nr_orphans++;
+		if (afi->f_eventfd)
+			eventfd_signal(afi->f_eventfd, 1);
+	}
+	if (next)
+		mod_timer(&afi->f_deadline, next);
+	if (expired)
+		wake_up(&afi->f_wait);
+	spin_unlock(&afi->f_lock);
+	spin_unlock_irqrestore(&aii->i_lock, flags);
+
+	if (expired)
+		asmfs_stat_add(aii, is_expired, expired);
+}
+
+/* Must be called with f_lock held */
+static void asm_set_deadline(struct asmfs_file_info *afi,
+			     struct asm_request *r, u32 usecs)
+{
+	r->r_deadline = r->r_elapsed + max(usecs_to_jiffies(usecs), 1UL);
+	if (!r->r_deadline)
+		r->r_deadline = 1;	/* 0 means none */
+
+	if (!timer_pending(&afi->f_deadline) ||
+	    time_before(r->r_deadline, afi->f_deadline.expires))
+		mod_timer(&afi->f_deadline, r->r_deadline);
+}
+
+
+#ifndef kapi_asm_bio_map_user
+# define kapi_asm_bio_map_user bio_map_user
+#endif
+
+/*
+ * Finds an open disk of this instance by handle, and counts an I/O
+ * against it so that it can't be closed under us.
+ */
+static struct asm_disk_info *asm_get_io_disk(struct inode *inode,
+					     u64 handle)
+{
+	struct asmdisk_find_inode_args args;
+	struct inode *disk_inode;
+	struct asm_disk_info *d;
+
+	args.fa_handle = (unsigned long)handle & ~ASM_INTEGRITY_HANDLE_MASK;
+	args.fa_inode = ASMFS_I(inode);
+	disk_inode = ilookup5(asmdisk_mnt->mnt_sb,
+			      (unsigned long)args.fa_handle,
+			      asmdisk_test, &args);
+	if (!disk_inode)
+		return NULL;
+
+	spin_lock_irq(&ASMFS_I(inode)->i_lock);
+
+	d = ASMDISK_I(disk_inode);
+	if (d->d_live)
+		atomic_inc(&d->d_ios);
+	else
+		d = NULL;	/* It's in the middle of closing */
+
+	spin_unlock_irq(&ASMFS_I(inode)->i_lock);
+	iput(disk_inode);
+
+	return d;
+}
+
+
+static void asm_mirror_put_bio(struct bio *bio)
+{
+	int i;
+
+	for (i = 0; i < bio->bi_vcnt; i++)
+		__free_page(bio->bi_io_vec[i].bv_page);
+	bio_put(bio);
+}
+
+/* A bio over fresh pages, for a hedge of a mirrored read */
+static struct bio *asm_mirror_read_bio(size_t count)
+{
+	struct bio *bio;
+	struct page *page;
+	unsigned int len, nr = (count + PAGE_SIZE - 1) >> PAGE_SHIFT;
+
+	if (nr > BIO_MAX_PAGES)
+		return NULL;
+
+	bio = bio_alloc(GFP_NOIO, nr);
+	if (!bio)
+		return NULL;
+
+	while (count) {
+		len = min_t(size_t, count, PAGE_SIZE);
+		page = alloc_page(GFP_NOIO);
+		if (!page || (bio_add_page(bio, page, len, 0) < len)) {
+			if (page)
+				__free_page(page);
+			asm_mirror_put_bio(bio);
+			return NULL;
+		}
+		count -= len;
+	}
+
+	return bio;
+}
+
+/* Copies the winning hedge into the caller's pages, which can sleep */
+static void asm_mirror_copy(struct bio *dst, struct bio *src)
+{
+	struct bio_vec *dv = dst->bi_io_vec, *sv = src->bi_io_vec;
+	unsigned int doff = 0, soff = 0, len;
+	char *to, *from;
+
+	while ((dv < dst->bi_io_vec + dst->bi_vcnt) &&
+	       (sv < src->bi_io_vec + src->bi_vcnt)) {
+		len = min(dv->bv_len - doff, sv->bv_len - soff);
+		to = kmap(dv->bv_page);
+		from = kmap(sv->bv_page);
+		memcpy(to + dv->bv_offset + doff,
+		       from + sv->bv_offset + soff, len);
+		kunmap(sv->bv_page);
+		kunmap(dv->bv_page);
+
+		doff += len;
+		soff += len;
+		if (doff == dv->bv_len) {
+			dv++;
+			doff = 0;
+		}
+		if (soff == sv->bv_len) {
+			sv++;
+			soff = 0;
+		}
+	}
+}
+
+static void asm_mirror_retire(struct asm_mirror *m)
+{
+	struct asmfs_file_info *afi = m->m_file;
+	struct bio *bio = NULL;
+	int i;
+
+	mlog(ML_REQUEST, "Retiring mirror set 0x%p\n", m);
+
+	del_timer_sync(&m->m_timer);
+	for (i = 0; i < m->m_nr; i++) {
+		if (m->m_priv[i])
+			asm_mirror_put_bio(m->m_priv[i]);
+		if (i)
+			bio_put(m->m_bios[i]);
+	}
+	/* A read's mapped bio went back to the request */
+	if (m->m_write)
+		bio = m->m_bios[0];
+
+	spin_lock_irq(&afi->f_lock);
+	if (bio) {
+		bio->bi_private = afi->f_bio_free;
+		afi->f_bio_free = bio;
+		afi->f_nr_bio_free++;
+	}
+	afi->f_nr_mirrors--;
+	/* Under f_lock, so release can't free afi under us */
+	wake_up(&afi->f_wait);
+	spin_unlock_irq(&afi->f_lock);
+
+	for (i = 0; i < m->m_nr; i++)
+		asm_disk_io_done(m->m_disks[i]);
+	kfree(m);
+}
+
+/*
+ * Queues m_work, for which the caller took an m_ref under f_lock.
+ * If it was already queued, that run holds a reference of its own,
+ * so dropping ours can never be the last.
+ */
+static void asm_mirror_kick(struct asm_mirror *m)
+{
+	unsigned long flags;
+
+	if (schedule_work(&m->m_work))
+		return;
+
+	spin_lock_irqsave(&m->m_file->f_lock, flags);
+	m->m_ref--;
+	spin_unlock_irqrestore(&m->m_file->f_lock, flags);
+}
+
+static void asm_end_mirror_bio(struct bio *bio, int error)
+{
+	struct asm_mirror *m = bio->bi_private;
+	struct asmfs_file_info *afi = m->m_file;
+	struct asm_request *r = NULL;
+	unsigned long flags;
+	int i, priv, kick = 0;
+
+	mlog_entry("(0x%p, %d)\n", bio, error);
+
+	for (i = 0; i < m->m_nr; i++) {
+		if ((m->m_bios[i] == bio) || (m->m_priv[i] == bio))
+			break;
+	}
+	priv = (m->m_priv[i] == bio);
+	if (!error && !m->m_write)
+		asm_disk_lat_add(m->m_disks[i],
+				 ktime_us_delta(ktime_get(), m->m_start[i]));
+
+	mlog(ML_REQUEST|ML_BIO,
+	     "Completed bio 0x%p, copy %d of mirror set 0x%p\n",
+	     bio, i, m);
+
+	spin_lock_irqsave(&afi->f_lock, flags);
+	m->m_out--;
+	if (!m->m_write && !priv)
+		m->m_mapped = 0;
+	if (error)
+		m->m_failed |= 1 << i;
+	else
+		m->m_good++;
+
+	if (!m->m_done) {
+		if (m->m_write) {
+			/* The buffer is the caller's again only now */
+			if (!m->m_out) {
+				r = m->m_req;
+				if (m->m_good >= m->m_quorum)
+					error = 0;
+				else if (!error)
+					error = -EIO;
+			}
+		} else if (!error && !priv) {
+			/* Already in the buffer */
+			r = m->m_req;
+		} else if (!error) {
+			/* Not over a copy still reading into the buffer */
+			if (!m->m_mapped) {
+				m->m_done = 1;
+				m->m_copy = i + 1;
+				kick = 1;
+			} else if (!m->m_win)
+				m->m_win = i + 1;
+		} else if (!priv && m->m_win) {
+			m->m_done = 1;
+			m->m_copy = m->m_win;
+			kick = 1;
+		} else if (!m->m_out && (m->m_next == m->m_nr)) {
+			r = m->m_req;
+		} else if (!m->m_out) {
+			/* Everything sent has failed, try the next */
+			kick = 1;
+		}
+	}
+
+	if (r) {
+		m->m_done = 1;
+		if (m->m_write)
+			r->r_bio = NULL;
+		r->r_edetail = m->m_failed;
+	}
+
+	/* Holds m over asm_end_ioc(), and retires it if we were last */
+	if (r || (m->m_done && !m->m_out))
+		kick = 1;
+	if (kick)
+		m->m_ref++;
 	spin_unlock_irqrestore(&afi->f_lock, flags);
 
-	if (d) {
-		atomic_dec(&d->d_ios);
-		if (atomic_read(&d->d_ios) < 0) {
-			mlog(ML_ERROR,
-			     "d_ios underflow on disk 0x%p (dev %X)\n",
-			     d, d->d_bdev->bd_dev);
-			atomic_set(&d->d_ios, 0);
+	if (r)
+		asm_end_ioc(r, error ? 0 : r->r_count, error);
+	if (kick)
+		asm_mirror_kick(m);
+
+	mlog_exit_void();
+}
+#ifndef kapi_asm_end_mirror_bio
+# define kapi_asm_end_mirror_bio asm_end_mirror_bio
+#endif
+
+static void asm_mirror_work(struct work_struct *work)
+{
+	struct asm_mirror *m = container_of(work, struct asm_mirror,
+					    m_work);
+	struct asmfs_file_info *afi = m->m_file;
+	struct asmfs_inode_info *aii = ASMFS_I(ASMFS_F2I(afi->f_file));
+	struct asmfs_sb_info *asb = ASMFS_SB(aii->vfs_inode.i_sb);
+	struct asm_request *r;
+	struct bio *bio = NULL, *priv = NULL;
+	unsigned long delay;
+	int i, retire;
+
+	spin_lock_irq(&afi->f_lock);
+	if (m->m_copy) {
+		/* The buffer is free, and our m_ref keeps m */
+		i = m->m_copy - 1;
+		m->m_copy = 0;
+		r = m->m_req;
+		spin_unlock_irq(&afi->f_lock);
+
+		asm_mirror_copy(r->r_bio, m->m_priv[i]);
+		asm_end_ioc(r, r->r_count, 0);
+
+		spin_lock_irq(&afi->f_lock);
+		goto out;
+	}
+
+	if (m->m_done || (m->m_next == m->m_nr))
+		goto out;
+
+	i = m->m_next;
+	if (m->m_mapped) {
+		spin_unlock_irq(&afi->f_lock);
+		priv = asm_mirror_read_bio(m->m_count);
+		spin_lock_irq(&afi->f_lock);
+
+		/* Without pages of its own, the copy waits for a failure */
+		if (m->m_done || (m->m_next != i) || (!priv && m->m_mapped))
+			goto out;
+	}
+
+	m->m_next++;
+	if (m->m_mapped) {
+		/* m_bios[i] is unsent, so still where the copy lives */
+		priv->bi_bdev = m->m_bios[i]->bi_bdev;
+		priv->bi_sector = m->m_bios[i]->bi_sector;
+		priv->bi_end_io = kapi_asm_end_mirror_bio;
+		priv->bi_private = m;
+		bio = m->m_priv[i] = priv;
+		priv = NULL;
+	} else {
+		bio = m->m_bios[i];
+		m->m_mapped = 1;
+	}
+	m->m_start[i] = ktime_get();
+	m->m_out++;
+
+	/* Set up before the bio can come back and free us */
+	if (m->m_next < m->m_nr) {
+		delay = asm_hedge_delay(asb, m->m_disks[i]);
+		if (delay)
+			mod_timer(&m->m_timer, jiffies + delay);
+	}
+
+out:
+	retire = !--m->m_ref && m->m_done && !m->m_out;
+	spin_unlock_irq(&afi->f_lock);
+
+	if (priv)
+		asm_mirror_put_bio(priv);
+	if (bio) {
+		mlog(ML_REQUEST|ML_BIO,
+		     "Sending mirror bio 0x%p for set 0x%p\n", bio, m);
+		asmfs_stat_add(aii, is_hedged, 1);
+		submit_bio(READ, bio);
+	}
+	if (retire)
+		asm_mirror_retire(m);
+}
+
+static void asm_mirror_timer(unsigned long data)
+{
+	struct asm_mirror *m = (struct asm_mirror *)data;
+	unsigned long flags;
+	int kick;
+
+	/* Sending may sleep */
+	spin_lock_irqsave(&m->m_file->f_lock, flags);
+	kick = !m->m_done && (m->m_next < m->m_nr);
+	if (kick)
+		m->m_ref++;
+	spin_unlock_irqrestore(&m->m_file->f_lock, flags);
+
+	if (kick)
+		asm_mirror_kick(m);
+}
+
+/*
+ * Called from asm_submit_io() once the request's bio is mapped.
+ * Finds the other copies and clones the bio for each.
+ */
+static int asm_mirror_setup(struct file *file, struct asm_request *r,
+			    asm_ioc *ioc, int rw)
+{
+	struct inode *inode = ASMFS_F2I(file);
+	struct asm_disk_info *d = r->r_disk;
+	struct oracleasm_mirror_v2 mr;
+	struct asm_mirror *m;
+	struct bio *bio;
+	unsigned int shift = d->d_blksize_bits - 9;
+	int i, ret;
+
+	if (copy_from_user(&mr,
+			   (struct oracleasm_mirror_v2 __user *)(unsigned long)ioc->check_asm_ioc,
+			   sizeof(mr)))
+		return -EFAULT;
+
+	if ((mr.mr_magic != ASM_MIRROR_MAGIC) || !mr.mr_count ||
+	    (mr.mr_count > ASM_MAX_MIRRORS - 1) ||
+	    ((rw == WRITE) && (mr.mr_quorum > mr.mr_count + 1)))
+		return -EINVAL;
+
+	m = kzalloc(sizeof(*m), GFP_KERNEL);
+	if (!m)
+		return -ENOMEM;
+
+	m->m_req = r;
+	m->m_file = ASMFS_FILE(file);
+	m->m_count = r->r_count;
+	m->m_write = (rw == WRITE);
+	if (m->m_write)
+		r->r_op = ASM_WRITE_MIRRORED;
+	m->m_quorum = mr.mr_quorum ? mr.mr_quorum : mr.mr_count + 1;
+	init_timer(&m->m_timer);
+	m->m_timer.data = (unsigned long)m;
+	m->m_timer.function = asm_mirror_timer;
+	INIT_WORK(&m->m_work, asm_mirror_work);
+
+	/* Our own count, for after the request lets go */
+	atomic_inc(&d->d_ios);
+	m->m_disks[0] = d;
+	m->m_bios[0] = r->r_bio;
+	m->m_nr = 1;
+
+	for (i = 0; i < mr.mr_count; i++) {
+		ret = -ENODEV;
+		d = asm_get_io_disk(inode, mr.mr_copies[i].mc_disk);
+		if (!d)
+			goto out_free;
+		m->m_disks[m->m_nr] = d;
+
+		ret = -EINVAL;
+		if ((mr.mr_copies[i].mc_first !=
+		     (unsigned long)mr.mr_copies[i].mc_first) ||
+		    (d->d_blksize_bits != r->r_disk->d_blksize_bits) ||
+		    (d->d_iprofile != ASM_IPROF_NONE) ||
+		    (r->r_count > d->d_max_bytes) ||
+		    (d->d_nr_sectors &&
+		     !asm_disk_in_range(d, mr.mr_copies[i].mc_first,
+					ioc->rcount_asm_ioc))) {
+			asm_disk_io_done(d);
+			goto out_free;
+		}
+
+		ret = -ENOMEM;
+		bio = bio_clone(r->r_bio, GFP_KERNEL);
+		if (!bio) {
+			asm_disk_io_done(d);
+			goto out_free;
 		}
+		bio->bi_bdev = d->d_bdev;
+		bio->bi_sector = (sector_t)mr.mr_copies[i].mc_first << shift;
+		bio->bi_end_io = kapi_asm_end_mirror_bio;
+		bio->bi_private = m;
+		m->m_bios[m->m_nr++] = bio;
 	}
 
-	r->r_elapsed = ((jiffies - r->r_elapsed) * 1000000) / HZ;
+	r->r_bio->bi_end_io = kapi_asm_end_mirror_bio;
+	r->r_bio->bi_private = m;
+	r->r_mirror = m;
+
+	return 0;
+
+out_free:
+	asm_mirror_free(m);
+	return ret;
+}
+
+/*
+ * Sends the first copy of a read, or every copy of a write.  Called
+ * from asm_dispatch_io() once the throttle lets the request go.
+ */
+static void asm_mirror_start(struct asm_request *r)
+{
+	struct asm_mirror *m = r->r_mirror;
+	struct asmfs_file_info *afi = m->m_file;
+	struct asmfs_inode_info *aii = ASMFS_I(ASMFS_F2I(afi->f_file));
+	unsigned long delay = 0;
+	int i, nr, rw = r->r_rw;
+
+	spin_lock_irq(&afi->f_lock);
+	afi->f_nr_mirrors++;
+	nr = m->m_write ? m->m_nr : 1;
+	for (i = 0; i < nr; i++)
+		m->m_start[i] = ktime_get();
+	m->m_out = m->m_next = nr;
+	if (!m->m_write) {
+		m->m_mapped = 1;
+		delay = asm_hedge_delay(ASMFS_SB(aii->vfs_inode.i_sb),
+					m->m_disks[0]);
+	}
+	if (delay)
+		mod_timer(&m->m_timer, jiffies + delay);
+	spin_unlock_irq(&afi->f_lock);
+
+	mlog(ML_REQUEST|ML_BIO,
+	     "Submitting mirror set 0x%p for request 0x%p\n", m, r);
+	trace_oracleasm_bio_dispatch((u64)(unsigned long)r, r->r_bio, rw);
+	r->r_start = ktime_get();
+
+	/* m_out covers the copies not yet sent, so m stays put */
+	for (i = 0; i < nr; i++)
+		submit_bio(rw, m->m_bios[i]);
+}
+
+/*
+ * REQ_FLUSH and REQ_FUA arrived in 2.6.37.  Before that the only way
+ * to get either is a barrier, which gives both.
+ */
+#ifdef QUEUE_FLUSH_FLAGS
+# define ASM_RW_FUA		REQ_FUA
+# define ASM_RW_PREFLUSH	REQ_FLUSH
+#else
+# define ASM_RW_FUA		WRITE_BARRIER
+# define ASM_RW_PREFLUSH	WRITE_BARRIER
+#endif
 
-	mlog(ML_REQUEST, "Finished request 0x%p\n", r);
+#if defined(BLKDEV_ISSUE_FLUSH_THREE)
+# define asm_issue_flush(_bdev)					\
+	blkdev_issue_flush((_bdev), GFP_KERNEL, NULL)
+#elif defined(BLKDEV_IFL_WAIT)
+# define asm_issue_flush(_bdev)					\
+	blkdev_issue_flush((_bdev), GFP_KERNEL, NULL, BLKDEV_IFL_WAIT)
+#else
+# define asm_issue_flush(_bdev)	blkdev_issue_flush((_bdev), NULL)
+#endif
 
-	wake_up(&afi->f_wait);
+#ifdef BLKDEV_ISSUE_DISCARD
+/* Before 2.6.37 blkdev_issue_discard() only waits when asked to */
+# if defined(BLKDEV_IFL_WAIT)
+#  define ASM_DISCARD_WAIT	BLKDEV_IFL_WAIT
+# elif defined(DISCARD_FL_WAIT)
+#  define ASM_DISCARD_WAIT	DISCARD_FL_WAIT
+# else
+#  define ASM_DISCARD_WAIT	0
+# endif
+# define asm_issue_discard(_bdev, _sector, _nr)			\
+	blkdev_issue_discard((_bdev), (_sector), (_nr), GFP_KERNEL,	\
+			     ASM_DISCARD_WAIT)
+#else
+# define asm_issue_discard(_bdev, _sector, _nr)	(-EOPNOTSUPP)
+#endif  /* BLKDEV_ISSUE_DISCARD */
 
-	mlog_exit_void();
-}  /* asm_finish_io() */
+#ifdef QUEUE_DISCARD_ZEROES
+# define asm_discard_zeroes(_q)					\
+	(blk_queue_discard(_q) && queue_discard_zeroes_data(_q))
+#else
+# define asm_discard_zeroes(_q)	((void)(_q), 0)
+#endif
 
+#ifdef BLKDEV_ISSUE_ZEROOUT
+# define asm_issue_zeroout(_bdev, _sector, _nr)			\
+	blkdev_issue_zeroout((_bdev), (_sector), (_nr), GFP_KERNEL)
+#else
+struct asm_zero_wait {
+	struct completion zw_done;
+	int zw_error;
+};
 
-static void asm_end_ioc(struct asm_request *r, unsigned int bytes_done,
-			int error)
+static void asm_end_zero_bio(struct bio *bio, int error)
 {
-	mlog_entry("(0x%p, %u, %d)\n", r, bytes_done, error);
+	struct asm_zero_wait *zw = bio->bi_private;
 
-	mlog_bug_on_msg(!r, "No request\n");
-
-	mlog_bug_on_msg(!(r->r_status & ASM_SUBMITTED),
-			"Request 0x%p wasn't submitted\n", r);
+	zw->zw_error = error;
+	complete(&zw->zw_done);
+}
 
-	mlog(ML_REQUEST,
-	     "Ending request 0x%p, bytes_done = %u, error = %d\n",
-	     r, bytes_done, error);
-	mlog(ML_REQUEST|ML_BIO,
-	     "Ending request 0x%p, bio 0x%p, len = %u\n",
-	     r, r->r_bio,
-	     bytes_done + (r->r_bio ? r->r_bio->bi_size : 0));
+#ifndef kapi_asm_end_zero_bio
+# define kapi_asm_end_zero_bio asm_end_zero_bio
+#endif
 
-	switch (error) {
-		default:
-			mlog(ML_REQUEST|ML_ERROR,
-			     "Invalid error of %d on request 0x%p!\n",
-			     error, r);
-			r->r_error = ASM_ERR_INVAL;
-			r->r_status |= ASM_LOCAL_ERROR;
-			break;
+/* No blkdev_issue_zeroout(), so write the zero page over the range */
+static int asm_issue_zeroout(struct block_device *bdev, sector_t sector,
+			     sector_t nr_sects)
+{
+	struct asm_zero_wait zw;
+	struct bio *bio;
+	unsigned int len;
+	int ret = 0;
 
-		case 0:
-			break;
+	while (nr_sects && !ret) {
+		bio = bio_alloc(GFP_KERNEL, BIO_MAX_PAGES);
+		if (!bio)
+			return -ENOMEM;
 
-		case -EFAULT:
-			r->r_error = ASM_ERR_FAULT;
-			r->r_status |= ASM_LOCAL_ERROR;
-			break;
+		bio->bi_sector = sector;
+		bio->bi_bdev = bdev;
+		bio->bi_end_io = kapi_asm_end_zero_bio;
+		bio->bi_private = &zw;
 
-		case -EIO:
-		case -ENODATA:
-		case -EREMOTEIO:
-			r->r_error = ASM_ERR_IO;
-			break;
+		while (nr_sects) {
+			len = min_t(sector_t, nr_sects, PAGE_SIZE >> 9);
+			if (bio_add_page(bio, ZERO_PAGE(0), len << 9, 0) <
+			    (len << 9))
+				break;
+			nr_sects -= len;
+			sector += len;
+		}
 
-		case -EILSEQ:
-			r->r_error = asm_integrity_error(r);
-			break;
+		if (!bio->bi_size) {
+			bio_put(bio);
+			return -EIO;
+		}
 
-		case -ENOLINK:
-		case -EBADE:
-		case -ENODEV:
-			r->r_error = ASM_ERR_NODEV;
-			r->r_status |= ASM_LOCAL_ERROR;
-			break;
+		init_completion(&zw.zw_done);
+		submit_bio(WRITE, bio);
+		wait_for_completion(&zw.zw_done);
+		ret = zw.zw_error;
+		bio_put(bio);
+	}
 
-		case -ENOMEM:
-			r->r_error = ASM_ERR_NOMEM;
-			r->r_status |= ASM_LOCAL_ERROR;
-			break;
+	return ret;
+}
+#endif  /* BLKDEV_ISSUE_ZEROOUT */
 
-		case -EINVAL:
-			r->r_error = ASM_ERR_INVAL;
-			r->r_status |= ASM_LOCAL_ERROR;
-			break;
+static void asm_nobuf_work(struct work_struct *work)
+{
+	struct asm_request *r =
+		container_of(work, struct asm_request, r_work);
+	struct block_device *bdev = r->r_disk->d_bdev;
+	struct request_queue *q = bdev_get_queue(bdev);
+	sector_t nr_sects = asm_request_bytes(r) >> 9;
+	int ret = -EOPNOTSUPP, stop = 0;
+
+	/* Nobody wants the rest of one that was cancelled or expired */
+	spin_lock_irq(&r->r_file->f_lock);
+	if (r->r_orphan) {
+		r->r_status |= ASM_CANCELLED;
+		r->r_error = ASM_ERR_CANCELLED;
+		stop = 1;
+	} else if (r->r_expired) {
+		r->r_error = ASM_ERR_TIMEDOUT;
+		stop = 1;
 	}
+	spin_unlock_irq(&r->r_file->f_lock);
 
-	asm_finish_io(r);
-
-	mlog_exit_void();
-}  /* asm_end_ioc() */
+	if (stop) {
+		mlog(ML_REQUEST, "Stopping request 0x%p early\n", r);
+		asm_finish_io(r);
+		return;
+	}
 
+	if (r->r_op == ASM_FLUSH) {
+		mlog(ML_REQUEST|ML_BIO, "Flushing for request 0x%p\n", r);
+		ret = asm_issue_flush(bdev);
+		goto out;
+	}
 
-static void asm_end_bio_io(struct bio *bio, int error)
-{
-	struct asm_request *r;
+	mlog(ML_REQUEST|ML_BIO,
+	     "Running %s of %llu sectors at %llu for request 0x%p\n",
+	     (r->r_op == ASM_DISCARD) ? "discard" : "write-zeroes",
+	     (unsigned long long)nr_sects,
+	     (unsigned long long)r->r_sector, r);
 
-	mlog_entry("(0x%p, %d)\n", bio, error);
+	/* A discard is only good for zeroing if it reads back as zeroes */
+	if ((r->r_op == ASM_DISCARD) || asm_discard_zeroes(q))
+		ret = asm_issue_discard(bdev, r->r_sector, nr_sects);
 
-	mlog(ML_BIO, "bio 0x%p, bi_size is %u\n", bio, bio->bi_size);
+	if ((ret == -EOPNOTSUPP) && (r->r_op == ASM_WRITE_ZEROES))
+		ret = asm_issue_zeroout(bdev, r->r_sector, nr_sects);
 
-	r = bio->bi_private;
+	if (ret)
+		goto out;
 
-	mlog(ML_REQUEST|ML_BIO,
-	     "Completed bio 0x%p for request 0x%p\n", bio, r);
-	if (atomic_dec_and_test(&r->r_bio_count)) {
-		asm_end_ioc(r, r->r_count - (r->r_bio ?
-					     r->r_bio->bi_size : 0),
-			    error);
-	}
+	r->r_sector += nr_sects;
+	r->r_left -= nr_sects << 9;
+	if (!r->r_left)
+		goto out;
 
-	mlog_exit_void();
-}  /* asm_end_bio_io() */
-#ifndef kapi_asm_end_bio_io
-# define kapi_asm_end_bio_io asm_end_bio_io
-#endif
+	/* Give up our slot, and get back in line for the next chunk */
+	if (r->r_throttled)
+		asm_throttle_done(r);
+	if (!asm_throttle_io(r))
+		asm_dispatch_io(r);
+	return;
 
-#ifndef kapi_asm_bio_map_user
-# define kapi_asm_bio_map_user bio_map_user
-#endif
+out:
+	asm_end_ioc(r, ret ? 0 : r->r_count, ret);
+}
 
 static int asm_submit_io(struct file *file,
 			 asm_ioc __user *user_iocp,
-			 asm_ioc *ioc)
+			 asm_ioc *ioc, struct kiocb *iocb)
 {
 	int ret, rw = READ;
+	unsigned int life;
+	sector_t sector;
 	struct inode *inode = ASMFS_F2I(file);
-	struct asmdisk_find_inode_args args;
 	struct asm_request *r;
 	struct asm_disk_info *d;
-	struct inode *disk_inode;
 	struct block_device *bdev;
 	struct oracleasm_integrity_v2 *it;
 
-	mlog_entry("(0x%p, 0x%p, 0x%p)\n", file, user_iocp, ioc);
+	mlog_entry("(0x%p, 0x%p, 0x%p, 0x%p)\n", file, user_iocp, ioc, iocb);
 
 	if (!ioc) {
 		mlog_exit(-EINVAL);
@@ -1313,7 +3446,11 @@ static int asm_submit_io(struct file *file,
 		return -EINVAL;
 	}
 
-	r = asm_request_alloc();
+	r = asm_request_alloc(ASMFS_SB(inode->i_sb));
+	if (!r && iocb) {
+		mlog_exit(-EAGAIN);
+		return -EAGAIN;
+	}
 	if (!r) {
 		u16 status = ASM_FREE | ASM_ERROR | ASM_LOCAL_ERROR |
 			ASM_BUSY;
@@ -1334,42 +3471,26 @@ static int asm_submit_io(struct file *file,
 	     "New request at 0x%p alloc()ed for user ioc at 0x%p\n",
 	     r, user_iocp);
 
+	asmfs_stat_add(ASMFS_I(inode), is_submitted, 1);
+
 	r->r_file = ASMFS_FILE(file);
 	r->r_ioc = user_iocp;  /* Userspace asm_ioc */
+	r->r_iocb = iocb;
 
 	spin_lock_irq(&ASMFS_FILE(file)->f_lock);
 	list_add(&r->r_list, &ASMFS_FILE(file)->f_ios);
+	ASMFS_FILE(file)->f_nr_ios++;
 	spin_unlock_irq(&ASMFS_FILE(file)->f_lock);
 
 	ret = -ENODEV;
-	args.fa_handle = (unsigned long)ioc->disk_asm_ioc &
-		~ASM_INTEGRITY_HANDLE_MASK;
-	args.fa_inode = ASMFS_I(inode);
-	disk_inode = ilookup5(asmdisk_mnt->mnt_sb,
-			      (unsigned long)args.fa_handle,
-			      asmdisk_test, &args);
-	if (!disk_inode)
-		goto out_error;
-
-	spin_lock_irq(&ASMFS_I(inode)->i_lock);
-
-	d = ASMDISK_I(disk_inode);
-	if (!d->d_live) {
-		/* It's in the middle of closing */
-		spin_unlock_irq(&ASMFS_I(inode)->i_lock);
-		iput(disk_inode);
+	d = asm_get_io_disk(inode, ioc->disk_asm_ioc);
+	if (!d)
 		goto out_error;
-	}
-
-	atomic_inc(&d->d_ios);
 	r->r_disk = d;
 
-	spin_unlock_irq(&ASMFS_I(inode)->i_lock);
-	iput(disk_inode);
-
 	bdev = d->d_bdev;
 
-	r->r_count = ioc->rcount_asm_ioc * asm_block_size(bdev);
+	r->r_count = (size_t)ioc->rcount_asm_ioc << d->d_blksize_bits;
 
 	/* linux only supports unsigned long size sector numbers */
 	mlog(ML_IOC,
@@ -1382,44 +3503,67 @@ static int asm_submit_io(struct file *file,
 	     (unsigned long)r->r_count);
 	/* Note that priority is ignored for now */
 	ret = -EINVAL;
-	if (!ioc->buffer_asm_ioc ||
+	if ((!ioc->buffer_asm_ioc &&
+	     !asm_op_nobuf(ioc->operation_asm_ioc)) ||
 	    (ioc->buffer_asm_ioc != (unsigned long)ioc->buffer_asm_ioc) ||
 	    (ioc->first_asm_ioc != (unsigned long)ioc->first_asm_ioc) ||
 	    (ioc->rcount_asm_ioc != (unsigned long)ioc->rcount_asm_ioc) ||
 	    (ioc->priority_asm_ioc > 7) ||
-	    (r->r_count > (queue_max_sectors(bdev_get_queue(bdev)) << 9)) ||
+	    ((ioc->flags_asm_ioc & ASM_IOF_DEADLINE) &&
+	     (iocb || !ioc->elaptime_asm_ioc)) ||
+	    ((ioc->flags_asm_ioc & (ASM_IOF_FUA | ASM_IOF_PREFLUSH)) &&
+	     (ioc->operation_asm_ioc != ASM_WRITE) &&
+	     (ioc->operation_asm_ioc != ASM_WRITE_MIRRORED)) ||
+	    ((r->r_count > d->d_max_bytes) &&
+	     !asm_op_nobuf(ioc->operation_asm_ioc)) ||
+	    ((r->r_count >> d->d_blksize_bits) != ioc->rcount_asm_ioc) ||
 	    (r->r_count < 0))
 		goto out_error;
 
-	/* Test device size, when known. (massaged from ll_rw_blk.c) */
-	if (bdev->bd_inode->i_size >> 9) {
-		sector_t maxsector = bdev->bd_inode->i_size >> 9;
-		sector_t sector = (sector_t)ioc->first_asm_ioc;
-		sector_t blks = (sector_t)ioc->rcount_asm_ioc;
-
-		if (maxsector < blks || maxsector - blks < sector) {
-			char b[BDEVNAME_SIZE];
-			mlog(ML_NOTICE|ML_IOC,
-			     "Attempt to access beyond end of device\n");
-			mlog(ML_NOTICE|ML_IOC,
-			     "dev %s: want=%llu, limit=%llu\n",
-			     bdevname(bdev, b),
-			     (unsigned long long)(sector + blks),
-			     (unsigned long long)maxsector);
-			goto out_error;
-		}
+	/*
+	 * Test device size, when known. (massaged from ll_rw_blk.c)
+	 * The capacity is cached, so an I/O past the end gets one more
+	 * chance in case the LUN has grown since we last looked.
+	 */
+	if (d->d_nr_sectors &&
+	    !asm_disk_in_range(d, ioc->first_asm_ioc, ioc->rcount_asm_ioc) &&
+	    (!asm_disk_resized(d) ||
+	     !asm_disk_in_range(d, ioc->first_asm_ioc,
+				ioc->rcount_asm_ioc))) {
+		char b[BDEVNAME_SIZE];
+		mlog(ML_NOTICE|ML_IOC,
+		     "Attempt to access beyond end of device\n");
+		mlog(ML_NOTICE|ML_IOC,
+		     "dev %s: want=%llu+%u blocks, limit=%llu sectors\n",
+		     bdevname(bdev, b),
+		     (unsigned long long)ioc->first_asm_ioc,
+		     ioc->rcount_asm_ioc,
+		     (unsigned long long)d->d_nr_sectors);
+		goto out_error;
 	}
+	sector = (sector_t)ioc->first_asm_ioc << (d->d_blksize_bits - 9);
 
 
 	mlog(ML_REQUEST|ML_IOC,
 	     "Request 0x%p (user_ioc 0x%p) passed validation checks\n",
 	     r, user_iocp);
 
-	if (bdev_get_integrity(bdev))
+	trace_oracleasm_submit((u64)(unsigned long)r, bdev->bd_dev,
+			       (sector_t)ioc->first_asm_ioc <<
+			       (d->d_blksize_bits - 9),
+			       r->r_count, ioc->operation_asm_ioc);
+
+	/* Mirrored I/O has its copies in check_asm_ioc instead */
+	if ((d->d_iprofile != ASM_IPROF_NONE) &&
+	    !asm_op_mirrored(ioc->operation_asm_ioc))
 		it = (struct oracleasm_integrity_v2 *)ioc->check_asm_ioc;
 	else
 		it = NULL;
 
+	/* Software PI is copied out at reap, which aio never does */
+	if (it && iocb && asm_integrity_is_soft(d->d_iprofile))
+		goto out_error;
+
 	switch (ioc->operation_asm_ioc) {
 		default:
 			goto out_error;
@@ -1428,7 +3572,7 @@ static int asm_submit_io(struct file *file,
 		case ASM_READ:
 			rw = READ;
 
-			if (it && asm_integrity_check(it, bdev) < 0)
+			if (it && asm_integrity_check(it, d->d_iformat, bdev) < 0)
 				goto out_error;
 
 			break;
@@ -1436,7 +3580,36 @@ static int asm_submit_io(struct file *file,
 		case ASM_WRITE:
 			rw = WRITE;
 
-			if (it && asm_integrity_check(it, bdev) < 0)
+			if (it && asm_integrity_check(it, d->d_iformat, bdev) < 0)
+				goto out_error;
+
+			break;
+
+		case ASM_READ_MIRRORED:
+		case ASM_WRITE_MIRRORED:
+			rw = (ioc->operation_asm_ioc == ASM_READ_MIRRORED) ?
+				READ : WRITE;
+
+			if (iocb || (d->d_iprofile != ASM_IPROF_NONE) ||
+			    !ioc->check_asm_ioc)
+				goto out_error;
+
+			break;
+
+		case ASM_DISCARD:
+		case ASM_WRITE_ZEROES:
+			rw = WRITE;
+
+			if (it)
+				goto out_error;
+
+			break;
+
+		case ASM_FLUSH:
+			rw = WRITE;
+
+			/* The whole disk, not a range */
+			if (it || r->r_count)
 				goto out_error;
 
 			break;
@@ -1449,9 +3622,18 @@ static int asm_submit_io(struct file *file,
 
 	/* Not really an error, but hey, it's an end_io call */
 	ret = 0;
-	if (r->r_count == 0)
+	if ((r->r_count == 0) && (ioc->operation_asm_ioc != ASM_FLUSH))
 		goto out_error;
 
+
+	if (asm_op_nobuf(ioc->operation_asm_ioc)) {
+		r->r_op = ioc->operation_asm_ioc;
+		r->r_sector = sector;
+		r->r_left = r->r_count;
+		INIT_WORK(&r->r_work, asm_nobuf_work);
+		goto out_start;
+	}
+
 	ret = -ENOMEM;
 	r->r_bio = kapi_asm_bio_map_user(bdev_get_queue(bdev), bdev,
 					 (unsigned long)ioc->buffer_asm_ioc,
@@ -1475,15 +3657,31 @@ static int asm_submit_io(struct file *file,
 	/* Block layer always uses 512-byte sector addressing,
 	 * regardless of logical and physical block size.
 	 */
-	r->r_bio->bi_sector = ioc->first_asm_ioc * (asm_block_size(bdev) >> 9);
+	r->r_bio->bi_sector = sector;
+
+	/*
+	 * hint_asm_ioc used to be ignored, so don't fail what we don't
+	 * know; it just isn't counted.  The block layer here has nowhere
+	 * to take a lifetime hint.
+	 */
+	life = ioc->hint_asm_ioc & ASM_HINT_LIFE_MASK;
+	if ((rw == WRITE) && life && (life <= ASM_HINT_LIFE_EXTREME))
+		asmfs_stat_add(ASMFS_I(inode), is_life[life - 1], 1);
 
 	if (it) {
-		ret = asm_integrity_map(it, r, rw == READ);
+		if (asm_integrity_is_soft(d->d_iprofile))
+			ret = asm_integrity_soft_map(it, r, d->d_iprofile,
+						     d->d_blksize_bits,
+						     rw == WRITE);
+		else
+			ret = asm_integrity_map(it, r, rw == READ);
 
 		if (ret < 0) {
 			mlog(ML_ERROR|ML_BIO,
 			     "Could not attach integrity payload\n");
+			asm_integrity_unmap(r->r_bio);
 			bio_unmap_user(r->r_bio);
+			r->r_bio = NULL;
 			goto out_error;
 		}
 	}
@@ -1495,27 +3693,221 @@ static int asm_submit_io(struct file *file,
 	r->r_bio->bi_end_io = kapi_asm_end_bio_io;
 	r->r_bio->bi_private = r;
 
+	if (asm_op_mirrored(ioc->operation_asm_ioc)) {
+		ret = asm_mirror_setup(file, r, ioc, rw);
+		if (ret)
+			goto out_error;
+	}
+
+out_start:
 	r->r_elapsed = jiffies;  /* Set start time */
+	r->r_rw = rw;
+	if (ioc->flags_asm_ioc & ASM_IOF_FUA)
+		r->r_rw |= ASM_RW_FUA;
+	if (ioc->flags_asm_ioc & ASM_IOF_PREFLUSH)
+		r->r_rw |= ASM_RW_PREFLUSH;
 
 	atomic_set(&r->r_bio_count, 1);
 
-	mlog(ML_REQUEST|ML_BIO,
-	     "Submitting bio 0x%p for request 0x%p\n", r->r_bio, r);
-	submit_bio(rw, r->r_bio);
+	if (ioc->flags_asm_ioc & ASM_IOF_DEADLINE) {
+		spin_lock_irq(&ASMFS_FILE(file)->f_lock);
+		asm_set_deadline(ASMFS_FILE(file), r,
+				 ioc->elaptime_asm_ioc);
+		spin_unlock_irq(&ASMFS_FILE(file)->f_lock);
+	}
+
+	if (!asm_throttle_io(r))
+		asm_dispatch_io(r);
+
+out:
+	/* An aio request may already be completed and freed */
+	if (iocb)
+		ret = 0;
+	else
+		ret = asm_update_user_ioc(file, r);
+
+	mlog_exit(ret);
+	return ret;
+
+out_error:
+	mlog(ML_REQUEST, "Submit-side error %d for request 0x%p\n",
+	     ret,  r);
+	asm_end_ioc(r, 0, ret);
+	goto out;
+}  /* asm_submit_io() */
+
+
+/*
+ * A request still held by the throttle never reached the device, so
+ * cancelling it just tears it down.  One that has been dispatched
+ * can't be pulled back: it moves to f_orphans, keeping its bio, its
+ * d_ios count and its in-flight slot, and asm_finish_io() frees it
+ * whenever the device is done.  Either way the user's asm_ioc is
+ * completed and freed here and is never reaped.
+ */
+static int asm_cancel_io(struct file *file, asm_ioc __user *iocp)
+{
+	int ret, held = 0;
+	u64 p;
+	struct asmfs_file_info *afi = ASMFS_FILE(file);
+	struct asmfs_inode_info *aii = ASMFS_I(ASMFS_F2I(file));
+	struct asm_request *r, copy;
+
+	mlog_entry("(0x%p, 0x%p)\n", file, iocp);
+
+	if (copy_from_user(&p, &(iocp->reserved_asm_ioc),
+			   sizeof(p))) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	r = (struct asm_request *)(unsigned long)p;
+	if (!r) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* i_lock first, for f_held */
+	spin_lock_irq(&aii->i_lock);
+	spin_lock(&afi->f_lock);
+
+	ret = -EINVAL;
+	if (!r->r_file || (r->r_file != afi) ||
+	    list_empty(&r->r_list) || !(r->r_status & ASM_SUBMITTED) ||
+	    r->r_orphan || r->r_iocb || !r->r_disk)
+		goto out_unlock;
+
+	ret = -EALREADY;
+	if ((r->r_status & ASM_COMPLETED) || r->r_expired)
+		goto out_unlock;
+
+	/*
+	 * r_held is also busy while the dispatcher has the request on
+	 * its ready list, but by then it is counted against the limits.
+	 */
+	if (!list_empty(&r->r_held) && !r->r_throttled) {
+		list_del_init(&r->r_held);
+		afi->f_nr_held--;
+		if (list_empty(&afi->f_held))
+			list_del_init(&afi->f_throttle);
+		held = 1;
+	}
+
+	mlog(ML_REQUEST, "Cancelling %s request 0x%p\n",
+	     held ? "held" : "dispatched", r);
+
+	r->r_orphan = 1;
+	list_move(&r->r_list, &afi->f_orphans);
+	afi->f_nr_ios--;
+	afi->f_nr_orphans++;
+
+	/* r may be freed as soon as we unlock */
+	copy = *r;
+	copy.r_ioc = iocp;
+	copy.r_status |= ASM_COMPLETED | ASM_FREE | ASM_CANCELLED |
+		ASM_ERROR | ASM_LOCAL_ERROR;
+	copy.r_error = ASM_ERR_CANCELLED;
+	copy.r_edetail = 0;
+	copy.r_elapsed = ((jiffies - r->r_elapsed) * 1000000) / HZ;
+
+	spin_unlock(&afi->f_lock);
+	spin_unlock_irq(&aii->i_lock);
+
+	/* Never dispatched, so nothing else will finish it */
+	if (held)
+		asm_finish_io(r);
+
+	asmfs_stat_add(aii, is_completed, 1);
+	asmfs_stat_add(aii, is_errors, 1);
+	asmfs_stat_add(aii, is_cancelled, 1);
+
+	ret = asm_update_user_ioc(file, &copy);
 
 out:
+	mlog_exit(ret);
+	return ret;
+
+out_unlock:
+	spin_unlock(&afi->f_lock);
+	spin_unlock_irq(&aii->i_lock);
+	goto out;
+}  /* asm_cancel_io() */
+
+
+/*
+ * Hands a request on f_complete back to userspace and frees it.
+ * Called with f_lock held, which is dropped.  An expired request is
+ * handed back as timed out, and left with the device as an orphan.
+ */
+static int asm_reap_io(struct file *file, struct asm_request *r)
+{
+	struct asmfs_file_info *afi = ASMFS_FILE(file);
+	struct asm_request copy;
+	int ret;
+
+	list_del_init(&r->r_list);
+	afi->f_nr_complete--;
+
+	if (r->r_expired) {
+		r->r_expired = 0;
+		r->r_orphan = 1;
+		list_add(&r->r_list, &afi->f_orphans);
+
+		/* r may be freed as soon as we unlock */
+		copy = *r;
+		copy.r_status = ASM_SUBMITTED | ASM_COMPLETED | ASM_FREE |
+			ASM_ERROR;
+		copy.r_error = ASM_ERR_TIMEDOUT;
+		copy.r_edetail = 0;
+		copy.r_elapsed = ((r->r_deadline - r->r_elapsed) * 1000000) /
+			HZ;
+		spin_unlock_irq(&afi->f_lock);
+
+		asmfs_stat_add(ASMFS_I(ASMFS_F2I(file)), is_completed, 1);
+		asmfs_stat_add(ASMFS_I(ASMFS_F2I(file)), is_errors, 1);
+
+		trace_oracleasm_reap((u64)(unsigned long)r, copy.r_status,
+				     copy.r_error, copy.r_elapsed);
+
+		return asm_update_user_ioc(file, &copy);
+	}
+
+	r->r_file = NULL;
+	r->r_status |= ASM_FREE;
+
+	spin_unlock_irq(&afi->f_lock);
+
+	trace_oracleasm_reap((u64)(unsigned long)r, r->r_status, r->r_error,
+			     r->r_elapsed);
+
 	ret = asm_update_user_ioc(file, r);
 
-	mlog_exit(ret);
+	mlog(ML_REQUEST, "Freeing request 0x%p\n", r);
+	asm_request_free(r);
+
 	return ret;
+}
 
-out_error:
-	mlog(ML_REQUEST, "Submit-side error %d for request 0x%p\n",
-	     ret,  r);
-	asm_end_ioc(r, 0, ret);
-	goto out;
-}  /* asm_submit_io() */
 
+/*
+ * With the poll mount option, a waiter spins for up to spin
+ * microseconds before it sleeps, so a fast device doesn't pay for a
+ * wakeup.  _cond is read without f_lock; the caller checks again
+ * under the lock either way.
+ */
+#define asm_spin_until(_asb, _cond) do {				\
+	if ((_asb)->poll && (_asb)->spin_usecs) {			\
+		ktime_t __start = ktime_get();				\
+									\
+		while (!(_cond)) {					\
+			if (need_resched() || signal_pending(current) ||\
+			    (ktime_us_delta(ktime_get(), __start) >=	\
+			     (_asb)->spin_usecs))			\
+				break;					\
+			cpu_relax();					\
+		}							\
+	}								\
+} while (0)
 
 static int asm_maybe_wait_io(struct file *file,
 			     asm_ioc *iocp,
@@ -1549,7 +3941,8 @@ static int asm_maybe_wait_io(struct file *file,
 	spin_lock_irq(&afi->f_lock);
 	/* Is it valid? It's surely ugly */
 	if (!r->r_file || (r->r_file != afi) ||
-	    list_empty(&r->r_list) || !(r->r_status & ASM_SUBMITTED)) {
+	    list_empty(&r->r_list) || !(r->r_status & ASM_SUBMITTED) ||
+	    r->r_orphan) {
 		spin_unlock_irq(&afi->f_lock);
 		ret = -EINVAL;
 		goto out;
@@ -1558,8 +3951,12 @@ static int asm_maybe_wait_io(struct file *file,
 	mlog(ML_REQUEST|ML_IOC,
 	     "asm_request 0x%p is valid...we think\n", r);
 	if (!(r->r_status & (ASM_COMPLETED |
-			     ASM_BUSY | ASM_ERROR))) {
+			     ASM_BUSY | ASM_ERROR)) && !r->r_expired) {
 		spin_unlock_irq(&afi->f_lock);
+		asm_spin_until(ASMFS_SB(ASMFS_F2I(file)->i_sb),
+			       (ACCESS_ONCE(r->r_status) &
+				(ASM_COMPLETED | ASM_BUSY | ASM_ERROR)) ||
+			       ACCESS_ONCE(r->r_expired));
 		add_wait_queue(&afi->f_wait, &wait);
 		add_wait_queue(&to->wait, &to_wait);
 		do {
@@ -1571,8 +3968,9 @@ static int asm_maybe_wait_io(struct file *file,
 			set_task_state(tsk, TASK_INTERRUPTIBLE);
 
 			spin_lock_irq(&afi->f_lock);
-			if (r->r_status & (ASM_COMPLETED |
-					   ASM_BUSY | ASM_ERROR))
+			if ((r->r_status & (ASM_COMPLETED |
+					    ASM_BUSY | ASM_ERROR)) ||
+			    r->r_expired)
 				break;
 			d = r->r_disk;
 			if (d && d->d_bdev)
@@ -1627,16 +4025,7 @@ static int asm_maybe_wait_io(struct file *file,
 
 	mlog(ML_REQUEST|ML_IOC,
 	     "Removing request 0x%p for asm_ioc 0x%p\n", r, iocp);
-	list_del_init(&r->r_list);
-	r->r_file = NULL;
-	r->r_status |= ASM_FREE;
-
-	spin_unlock_irq(&afi->f_lock);
-
-	ret = asm_update_user_ioc(file, r);
-
-	mlog(ML_REQUEST, "Freeing request 0x%p\n", r);
-	asm_request_free(r);
+	ret = asm_reap_io(file, r);
 
 out:
 	mlog_exit(ret);
@@ -1665,17 +4054,9 @@ static int asm_complete_io(struct file *file,
 
 	l = afi->f_complete.prev;
 	r = list_entry(l, struct asm_request, r_list);
-	list_del_init(&r->r_list);
-	r->r_file = NULL;
-	r->r_status |= ASM_FREE;
-
-	spin_unlock_irq(&afi->f_lock);
-
 	*ioc = r->r_ioc;
 
-	ret = asm_update_user_ioc(file, r);
-
-	asm_request_free(r);
+	ret = asm_reap_io(file, r);
 
 	mlog_exit(ret);
 	return ret;
@@ -1689,6 +4070,8 @@ static int asm_wait_completion(struct file *file,
 {
 	int ret;
 	struct asmfs_file_info *afi = ASMFS_FILE(file);
+	struct asmfs_sb_info *asb = ASMFS_SB(ASMFS_F2I(file)->i_sb);
+	unsigned long want = min_t(unsigned long, asb->batch, io->io_complen);
 	struct task_struct *tsk = current;
 	DECLARE_WAITQUEUE(wait, tsk);
 	DECLARE_WAITQUEUE(to_wait, tsk);
@@ -1711,6 +4094,8 @@ static int asm_wait_completion(struct file *file,
 	}
 	spin_unlock_irq(&afi->f_lock);
 
+	asm_spin_until(asb, !list_empty(&afi->f_complete));
+
 	add_wait_queue(&afi->f_wait, &wait);
 	add_wait_queue(&to->wait, &to_wait);
 	do {
@@ -1722,8 +4107,14 @@ static int asm_wait_completion(struct file *file,
 		ret = 0;
 		set_task_state(tsk, TASK_INTERRUPTIBLE);
 
+		/*
+		 * With batch set, hold out for that many completions,
+		 * or for everything still outstanding if that's fewer.
+		 */
 		spin_lock_irq(&afi->f_lock);
-		if (!list_empty(&afi->f_complete)) {
+		if (afi->f_nr_complete &&
+		    ((afi->f_nr_complete >= want) ||
+		     list_empty(&afi->f_ios))) {
 			spin_unlock_irq(&afi->f_lock);
 			break;
 		}
@@ -1744,8 +4135,12 @@ static int asm_wait_completion(struct file *file,
 		}
 
 		ret = -ETIMEDOUT;
-		if (to->timed_out)
+		if (to->timed_out) {
+			/* Hand back a partial batch rather than nothing */
+			if (!list_empty(&afi->f_complete))
+				ret = 0;
 			break;
+		}
 		io_schedule();
 		if (signal_pending(tsk)) {
 			ret = -EINTR;
@@ -1782,7 +4177,7 @@ static inline int asm_submit_io_native(struct file *file,
 			break;
 
 		mlog(ML_IOC, "Submitting user asm_ioc 0x%p\n", iocp);
-		ret = asm_submit_io(file, iocp, &tmp);
+		ret = asm_submit_io(file, iocp, &tmp, NULL);
 		if (ret)
 			break;
 	}
@@ -1916,7 +4311,7 @@ static inline int asm_submit_io_thunk(struct file *file,
 		asm_promote_64(&tmp);
 
 		mlog(ML_IOC, "Submitting user asm_ioc 0x%p\n", iocp);
-		ret = asm_submit_io(file, (asm_ioc *)iocp, &tmp);
+		ret = asm_submit_io(file, (asm_ioc *)iocp, &tmp, NULL);
 		if (ret)
 			break;
 	}
@@ -2034,6 +4429,8 @@ static int asm_do_io(struct file *file, struct oracleasm_io_v2 *io,
 	int ret = 0;
 	u32 status = 0;
 	struct timeout to;
+	struct asmfs_inode_info *aii = ASMFS_I(ASMFS_F2I(file));
+	ktime_t wait_start;
 
 	mlog_entry("(0x%p, 0x%p, %d)\n", file, io, bpl);
 
@@ -2073,6 +4470,8 @@ static int asm_do_io(struct file *file, struct oracleasm_io_v2 *io,
 			goto out_to;
 	}
 
+	wait_start = ktime_get();
+
 	if (io->io_waitreqs) {
 		mlog(ML_ABI, "oracleasm_io_v2 has waits; waitlen %d\n",
 		     io->io_waitlen);
@@ -2085,7 +4484,7 @@ static int asm_do_io(struct file *file, struct oracleasm_io_v2 *io,
 #endif  /* BITS_PER_LONG == 64 */
 
 		if (ret)
-			goto out_to;
+			goto out_wait;
 
 		status |= ASM_IO_WAITED;
 	}
@@ -2104,16 +4503,26 @@ static int asm_do_io(struct file *file, struct oracleasm_io_v2 *io,
 						  &status);
 #endif  /* BITS_PER_LONG == 64 */
 
+		asmfs_stat_add(aii, is_reap_calls, 1);
 		if (ret < 0)
-			goto out_to;
+			goto out_wait;
+		asmfs_stat_add(aii, is_reaps, ret);
 		if (ret >= io->io_complen)
 			status |= ASM_IO_FULL;
 		ret = 0;
 	}
 
+out_wait:
+	if (io->io_waitreqs || io->io_completions)
+		asmfs_stat_add(aii, is_wait_usecs,
+			       ktime_us_delta(ktime_get(), wait_start));
+
 out_to:
-	if (io->io_timeout)
+	if (io->io_timeout) {
+		if (to.timed_out)
+			asmfs_stat_add(aii, is_timeouts, 1);
 		clear_timeout(&to);
+	}
 
 out:
 	if (put_user(status, (u32 *)(unsigned long)(io->io_statusp)))
@@ -2133,6 +4542,7 @@ static void asm_cleanup_bios(struct file *file)
 	while (afi->f_bio_free) {
 		bio = afi->f_bio_free;
 		afi->f_bio_free = bio->bi_private;
+		afi->f_nr_bio_free--;
 
 		spin_unlock_irq(&afi->f_lock);
 		mlog(ML_BIO, "Unmapping bio 0x%p\n", bio);
@@ -2145,6 +4555,45 @@ static void asm_cleanup_bios(struct file *file)
 	mlog_exit_void();
 }
 
+/*
+ * Completes aio requests.  Unmapping the bio may sleep, so this can't
+ * be done from asm_finish_io().
+ */
+static void asm_aio_work(struct work_struct *work)
+{
+	struct asmfs_file_info *afi =
+		container_of(work, struct asmfs_file_info, f_aio_work);
+	struct asm_request *r, *n;
+	struct kiocb *iocb;
+	long status, error;
+	LIST_HEAD(done);
+
+	spin_lock_irq(&afi->f_lock);
+	list_splice_init(&afi->f_aio_done, &done);
+	spin_unlock_irq(&afi->f_lock);
+
+	/* Don't touch afi from here on; the last aio_complete() may free it */
+	list_for_each_entry_safe(r, n, &done, r_list) {
+		list_del_init(&r->r_list);
+		if (r->r_bio) {
+			mlog(ML_BIO, "Unmapping bio 0x%p\n", r->r_bio);
+			asm_integrity_unmap(r->r_bio);
+			bio_unmap_user(r->r_bio);
+		}
+
+		r->r_status |= ASM_FREE;
+		trace_oracleasm_reap((u64)(unsigned long)r, r->r_status,
+				     r->r_error, r->r_elapsed);
+
+		iocb = r->r_iocb;
+		status = r->r_status;
+		error = (r->r_status & ASM_ERROR) ? r->r_error : 0;
+		asm_request_free(r);
+
+		aio_complete(iocb, status, error);
+	}
+}
+
 static int asmfs_file_open(struct inode * inode, struct file * file)
 {
 	struct asmfs_inode_info * aii;
@@ -2165,11 +4614,27 @@ static int asmfs_file_open(struct inode * inode, struct file * file)
 
 	afi->f_file = file;
 	afi->f_bio_free = NULL;
+	afi->f_eventfd = NULL;
+	INIT_LIST_HEAD(&afi->f_aio_done);
+	INIT_WORK(&afi->f_aio_work, asm_aio_work);
+	INIT_LIST_HEAD(&afi->f_held);
+	INIT_LIST_HEAD(&afi->f_throttle);
+	afi->f_nr_held = 0;
+	afi->f_pid = task_pid_nr(current);
+	get_task_comm(afi->f_comm, current);
+	afi->f_nr_ios = afi->f_nr_complete = afi->f_nr_bio_free = 0;
+	afi->f_nr_orphans = afi->f_nr_mirrors = 0;
+	init_timer(&afi->f_deadline);
+	afi->f_deadline.data = (unsigned long)afi;
+	afi->f_deadline.function = asm_deadline_func;
+	afi->f_completed = afi->f_lat_usecs = 0;
+	afi->f_lat_max = 0;
 	spin_lock_init(&afi->f_lock);
 	INIT_LIST_HEAD(&afi->f_ctx);
 	INIT_LIST_HEAD(&afi->f_disks);
 	INIT_LIST_HEAD(&afi->f_ios);
 	INIT_LIST_HEAD(&afi->f_complete);
+	INIT_LIST_HEAD(&afi->f_orphans);
 	init_waitqueue_head(&afi->f_wait);
 
 	aii = ASMFS_I(ASMFS_F2I(file));
@@ -2230,7 +4695,9 @@ static int asmfs_file_release(struct inode *inode, struct file *file)
 		set_task_state(tsk, TASK_UNINTERRUPTIBLE);
 
 		spin_lock_irq(&afi->f_lock);
-		if (list_empty(&afi->f_ios))
+		/* Orphans still hold pages and point at afi */
+		if (list_empty(&afi->f_ios) && !afi->f_nr_orphans &&
+		    !afi->f_nr_mirrors)
 		    break;
 
 		bdev = find_io_bdev(file);
@@ -2268,9 +4735,18 @@ static int asmfs_file_release(struct inode *inode, struct file *file)
 	}
 	spin_unlock_irq(&afi->f_lock);
 
+	/* f_ios is empty, so it won't rearm */
+	del_timer_sync(&afi->f_deadline);
+
 	/* And cleanup any pages from those I/Os */
 	asm_cleanup_bios(file);
 
+	/* The last aio completion may still be on its way out */
+	flush_work(&afi->f_aio_work);
+
+	if (afi->f_eventfd)
+		eventfd_ctx_put(afi->f_eventfd);
+
 	mlog(ML_ABI, "Done with afi 0x%p from filp 0x%p\n", afi, file);
 	file->private_data = NULL;
 	kfree(afi);
@@ -2360,10 +4836,7 @@ static ssize_t asmfs_svc_get_iid(struct file *file, char *buf, size_t size)
 	if (iid_info->gi_abi.ai_type != ASMOP_GET_IID)
 		goto out;
 
-	spin_lock_irq(&asb->asmfs_lock);
-	iid_info->gi_iid = (u64)asb->next_iid;
-	asb->next_iid++;
-	spin_unlock_irq(&asb->asmfs_lock);
+	iid_info->gi_iid = asmfs_iid_next(asb);
 
 	ret = 0;
 
@@ -2401,10 +4874,8 @@ static ssize_t asmfs_svc_check_iid(struct file *file, char *buf, size_t size)
 	if (iid_info->gi_abi.ai_type != ASMOP_CHECK_IID)
 		goto out;
 
-	spin_lock_irq(&asb->asmfs_lock);
-	if (iid_info->gi_iid >= (u64)asb->next_iid)
+	if (iid_info->gi_iid >= asmfs_iid_limit(asb))
 		iid_info->gi_iid = (u64)0;
-	spin_unlock_irq(&asb->asmfs_lock);
 
 	ret = 0;
 
@@ -2420,6 +4891,7 @@ static ssize_t asmfs_svc_query_disk(struct file *file, char *buf, size_t size)
 	struct oracleasm_query_disk_v2 *qd_info;
 	struct file *filp;
 	struct block_device *bdev;
+	unsigned int bsp;
 	int ret;
 
 	mlog_entry("(0x%p, 0x%p, %u)\n", file, buf, (unsigned int)size);
@@ -2454,15 +4926,45 @@ static ssize_t asmfs_svc_query_disk(struct file *file, char *buf, size_t size)
 
 	bdev = I_BDEV(filp->f_mapping->host);
 
+	/*
+	 * The caller may ask which size a given policy would use.
+	 * Older callers don't set qd_feature, so it only counts when
+	 * ASM_QDF_BSP_VALID says so.
+	 */
+	bsp = ASM_BSP_DEFAULT;
+	if (qd_info->qd_feature & ASM_QDF_BSP_VALID) {
+		ret = -EINVAL;
+		bsp = (qd_info->qd_feature >> ASM_QDF_BSP_SHIFT) &
+			ASM_BSP_MASK;
+		if (bsp == ASM_BSP_MASK)
+			goto out_put;
+	}
+	bsp = asm_resolve_bsp(bsp);
+
 	qd_info->qd_max_sectors = compute_max_sectors(bdev);
-	qd_info->qd_hardsect_size = asm_block_size(bdev);
-	qd_info->qd_feature = asm_integrity_format(bdev) &
-		ASM_INTEGRITY_QDF_MASK;
+	qd_info->qd_hardsect_size = asm_block_size(bdev, bsp);
+	qd_info->qd_feature = (asm_integrity_format(bdev) &
+			       ASM_INTEGRITY_QDF_MASK) |
+		(bsp << ASM_QDF_BSP_SHIFT) | ASM_QDF_BSP_VALID;
+#ifdef BLKDEV_ISSUE_DISCARD
+	if (blk_queue_discard(bdev_get_queue(bdev))) {
+		qd_info->qd_feature |= ASM_QDF_DISCARD;
+		if (asm_discard_zeroes(bdev_get_queue(bdev)))
+			qd_info->qd_feature |= ASM_QDF_DISCARD_ZEROES;
+	}
+#endif
+#ifdef QUEUE_FLUSH_FLAGS
+	if (bdev_get_queue(bdev)->flush_flags & REQ_FLUSH) {
+		qd_info->qd_feature |= ASM_QDF_WRITE_CACHE;
+		if (bdev_get_queue(bdev)->flush_flags & REQ_FUA)
+			qd_info->qd_feature |= ASM_QDF_FUA;
+	}
+#endif
 	mlog(ML_ABI|ML_DISK,
 	     "Querydisk returning qd_max_sectors = %u and "
-	     "qd_hardsect_size = %u, qd_integrity = %u\n",
+	     "qd_hardsect_size = %u, qd_integrity = %u, bsp = %u\n",
 	     qd_info->qd_max_sectors, qd_info->qd_hardsect_size,
-	     asm_integrity_format(bdev));
+	     asm_integrity_format(bdev), bsp);
 
 	ret = 0;
 
@@ -2481,6 +4983,7 @@ static ssize_t asmfs_svc_open_disk(struct file *file, char *buf, size_t size)
 	struct oracleasm_open_disk_v2 od_info;
 	struct block_device *bdev = NULL;
 	struct file *filp;
+	unsigned int bsp = ASM_BSP_DEFAULT;
 	int ret;
 
 	mlog_entry("(0x%p, 0x%p, %u)\n", file, buf, (unsigned int)size);
@@ -2511,6 +5014,14 @@ static ssize_t asmfs_svc_open_disk(struct file *file, char *buf, size_t size)
 	if (od_info.od_abi.ai_type != ASMOP_OPEN_DISK)
 		goto out_error;
 
+	/* od_flags was padding once, so ignore it unless it is marked */
+	if (od_info.od_flags & ASM_ODF_BSP_VALID) {
+		ret = -EINVAL;
+		bsp = od_info.od_flags & ASM_BSP_MASK;
+		if (bsp == ASM_BSP_MASK)
+			goto out_error;
+	}
+
 	ret = -ENODEV;
 	filp = fget(od_info.od_fd);
 	if (!filp)
@@ -2521,7 +5032,7 @@ static ssize_t asmfs_svc_open_disk(struct file *file, char *buf, size_t size)
 		if (S_ISBLK(filp->f_mapping->host->i_mode)) {
 			bdev = I_BDEV(filp->f_mapping->host);
 
-			ret = asm_open_disk(file, bdev);
+			ret = asm_open_disk(file, bdev, bsp);
 		}
 	}
 	fput(filp);
@@ -2592,6 +5103,121 @@ out_error:
 	return size;
 }
 
+static ssize_t asmfs_svc_eventfd(struct file *file, char *buf, size_t size)
+{
+	struct oracleasm_eventfd_v2 ef_info;
+	struct asmfs_file_info *afi = ASMFS_FILE(file);
+	struct eventfd_ctx *ctx = NULL, *old;
+	int ret;
+
+	mlog_entry("(0x%p, 0x%p, %u)\n", file, buf, (unsigned int)size);
+
+	if (size != sizeof(struct oracleasm_eventfd_v2)) {
+		mlog_exit(-EINVAL);
+		return -EINVAL;
+	}
+
+	if (copy_from_user(&ef_info,
+			   (struct oracleasm_eventfd_v2 __user *)buf,
+			   sizeof(struct oracleasm_eventfd_v2))) {
+		mlog_exit(-EFAULT);
+		return -EFAULT;
+	}
+
+	ret = asmfs_verify_abi(&ef_info.ef_abi);
+	if (ret)
+		goto out_error;
+
+	ret = -EBADR;
+	if (ef_info.ef_abi.ai_size !=
+	    sizeof(struct oracleasm_eventfd_v2))
+		goto out_error;
+	ret = -EBADRQC;
+	if (ef_info.ef_abi.ai_type != ASMOP_EVENTFD)
+		goto out_error;
+
+	if (ef_info.ef_fd != -1) {
+		ctx = eventfd_ctx_fdget(ef_info.ef_fd);
+		if (IS_ERR(ctx)) {
+			ret = PTR_ERR(ctx);
+			goto out_error;
+		}
+	}
+
+	spin_lock_irq(&afi->f_lock);
+	old = afi->f_eventfd;
+	afi->f_eventfd = ctx;
+	spin_unlock_irq(&afi->f_lock);
+
+	if (old)
+		eventfd_ctx_put(old);
+
+	ret = 0;
+
+out_error:
+	ef_info.ef_abi.ai_status = ret;
+	if (copy_to_user((struct oracleasm_eventfd_v2 __user *)buf,
+			 &ef_info,
+			 sizeof(struct oracleasm_eventfd_v2))) {
+		mlog_exit(-EFAULT);
+		return -EFAULT;
+	}
+
+	mlog_exit(size);
+	return size;
+}
+
+static ssize_t asmfs_svc_cancel(struct file *file, char *buf, size_t size)
+{
+	struct oracleasm_cancel_v2 cn_info;
+	int ret;
+
+	mlog_entry("(0x%p, 0x%p, %u)\n", file, buf, (unsigned int)size);
+
+	if (size != sizeof(struct oracleasm_cancel_v2)) {
+		mlog_exit(-EINVAL);
+		return -EINVAL;
+	}
+
+	if (copy_from_user(&cn_info,
+			   (struct oracleasm_cancel_v2 __user *)buf,
+			   sizeof(struct oracleasm_cancel_v2))) {
+		mlog_exit(-EFAULT);
+		return -EFAULT;
+	}
+
+	ret = asmfs_verify_abi(&cn_info.cn_abi);
+	if (ret)
+		goto out_error;
+
+	ret = -EBADR;
+	if (cn_info.cn_abi.ai_size !=
+	    sizeof(struct oracleasm_cancel_v2))
+		goto out_error;
+	ret = -EBADRQC;
+	if (cn_info.cn_abi.ai_type != ASMOP_CANCEL)
+		goto out_error;
+
+	/*
+	 * The asm_ioc32 and asm_ioc64 layouts agree up to the buffer
+	 * pointers, which cancellation never looks at.
+	 */
+	ret = asm_cancel_io(file,
+			    (asm_ioc __user *)(unsigned long)cn_info.cn_ioc);
+
+out_error:
+	cn_info.cn_abi.ai_status = ret;
+	if (copy_to_user((struct oracleasm_cancel_v2 __user *)buf,
+			 &cn_info,
+			 sizeof(struct oracleasm_cancel_v2))) {
+		mlog_exit(-EFAULT);
+		return -EFAULT;
+	}
+
+	mlog_exit(size);
+	return size;
+}
+
 static ssize_t asmfs_svc_io32(struct file *file, char *buf, size_t size)
 {
 	struct oracleasm_abi_info __user *user_abi_info;
@@ -2731,8 +5357,223 @@ static ssize_t asmfs_file_read(struct file *file, char *buf, size_t size, loff_t
 			ret = asmfs_svc_io64(file, (char *)buf, size);
 			break;
 #endif  /* BITS_PER_LONG == 64 */
+
+		case ASMOP_EVENTFD:
+			ret = asmfs_svc_eventfd(file, (char *)buf, size);
+			break;
+
+		case ASMOP_CANCEL:
+			ret = asmfs_svc_cancel(file, (char *)buf, size);
+			break;
+	}
+
+	return ret;
+}
+
+/* Readable while there are completions to reap */
+static unsigned int asmfs_file_poll(struct file *file, poll_table *wait)
+{
+	struct asmfs_file_info *afi = ASMFS_FILE(file);
+	unsigned int mask = 0;
+
+	poll_wait(file, &afi->f_wait, wait);
+
+	spin_lock_irq(&afi->f_lock);
+	if (!list_empty(&afi->f_complete))
+		mask |= POLLIN | POLLRDNORM;
+	spin_unlock_irq(&afi->f_lock);
+
+	return mask;
+}
+
+/*
+ * iid/.stats shows one line per instance file.  Instance files are
+ * plain files, so there is nowhere below them to hang a per-instance
+ * file; this one lists them all.  In-flight is submitted less
+ * completed, and the average wait is per I/O call that reaped.
+ * Cancelled and timed out requests count as completed with an error.
+ * The life_ columns count writes submitted with each lifetime hint.
+ */
+static int asmfs_stats_show(struct seq_file *seq, void *v)
+{
+	struct asmfs_sb_info *asb = seq->private;
+	struct asmfs_inode_info *aii;
+	struct asmfs_instance_stats sum, *st;
+	int cpu, i;
+
+	seq_printf(seq, "%-20s %12s %12s %8s %8s %16s %12s %12s %12s %8s %9s %8s %8s %12s %12s %12s %12s %12s\n",
+		   "iid", "submitted", "completed", "inflight", "errors",
+		   "bytes", "reaps", "reap_calls", "avg_wait_us", "timeouts",
+		   "cancelled", "expired", "hedged", "life_none",
+		   "life_short", "life_medium", "life_long", "life_extreme");
+
+	spin_lock(&asb->asmfs_lock);
+	list_for_each_entry(aii, &asb->asmfs_instances, i_instances) {
+		memset(&sum, 0, sizeof(sum));
+		for_each_possible_cpu(cpu) {
+			st = per_cpu_ptr(aii->i_stats, cpu);
+			sum.is_submitted += st->is_submitted;
+			sum.is_completed += st->is_completed;
+			sum.is_errors += st->is_errors;
+			sum.is_bytes += st->is_bytes;
+			sum.is_reaps += st->is_reaps;
+			sum.is_reap_calls += st->is_reap_calls;
+			sum.is_wait_usecs += st->is_wait_usecs;
+			sum.is_timeouts += st->is_timeouts;
+			sum.is_cancelled += st->is_cancelled;
+			sum.is_expired += st->is_expired;
+			sum.is_hedged += st->is_hedged;
+			for (i = 0; i < ASM_HINT_LIFE_EXTREME; i++)
+				sum.is_life[i] += st->is_life[i];
+		}
+
+		seq_printf(seq,
+			   "%-20s %12llu %12llu %8lld %8llu %16llu %12llu %12llu %12llu %8llu %9llu %8llu %8llu %12llu %12llu %12llu %12llu %12llu\n",
+			   aii->i_iid,
+			   (unsigned long long)sum.is_submitted,
+			   (unsigned long long)sum.is_completed,
+			   (long long)(sum.is_submitted - sum.is_completed),
+			   (unsigned long long)sum.is_errors,
+			   (unsigned long long)sum.is_bytes,
+			   (unsigned long long)sum.is_reaps,
+			   (unsigned long long)sum.is_reap_calls,
+			   (unsigned long long)(sum.is_reap_calls ?
+				div64_u64(sum.is_wait_usecs,
+					  sum.is_reap_calls) : 0),
+			   (unsigned long long)sum.is_timeouts,
+			   (unsigned long long)sum.is_cancelled,
+			   (unsigned long long)sum.is_expired,
+			   (unsigned long long)sum.is_hedged,
+			   (unsigned long long)sum.is_life[0],
+			   (unsigned long long)sum.is_life[1],
+			   (unsigned long long)sum.is_life[2],
+			   (unsigned long long)sum.is_life[3],
+			   (unsigned long long)sum.is_life[4]);
+	}
+	spin_unlock(&asb->asmfs_lock);
+
+	return 0;
+}
+
+static int asmfs_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, asmfs_stats_show, ASMFS_SB(inode->i_sb));
+}
+
+static struct file_operations asmfs_stats_operations = {
+	.open		= asmfs_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * iid/.contexts shows one line per open of an instance file, ie, per
+ * ASM process.  ios is what has been submitted but not completed,
+ * held is the part of that waiting on the in-flight limits, orphans
+ * are cancelled or expired requests the device still has, unreaped
+ * is what has completed but not been handed back, and bios is how
+ * many completed bios are waiting for the owner to unmap them.
+ * Latency is submit to completion, in microseconds.
+ */
+static int asmfs_contexts_show(struct seq_file *seq, void *v)
+{
+	struct asmfs_sb_info *asb = seq->private;
+	struct asmfs_inode_info *aii;
+	struct asmfs_file_info *afi;
+
+	seq_printf(seq, "%-20s %8s %-16s %8s %8s %8s %8s %8s %12s %12s %12s\n",
+		   "iid", "pid", "comm", "ios", "held", "orphans", "unreaped",
+		   "bios",
+		   "completed", "avg_lat_us", "max_lat_us");
+
+	spin_lock(&asb->asmfs_lock);
+	list_for_each_entry(aii, &asb->asmfs_instances, i_instances) {
+		spin_lock_irq(&aii->i_lock);
+		list_for_each_entry(afi, &aii->i_threads, f_ctx) {
+			spin_lock(&afi->f_lock);
+			seq_printf(seq,
+				   "%-20s %8d %-16s %8lu %8lu %8lu %8lu %8lu %12llu %12llu %12lu\n",
+				   aii->i_iid, afi->f_pid, afi->f_comm,
+				   afi->f_nr_ios, afi->f_nr_held,
+				   afi->f_nr_orphans,
+				   afi->f_nr_complete,
+				   afi->f_nr_bio_free,
+				   (unsigned long long)afi->f_completed,
+				   (unsigned long long)(afi->f_completed ?
+					div64_u64(afi->f_lat_usecs,
+						  afi->f_completed) : 0),
+				   afi->f_lat_max);
+			spin_unlock(&afi->f_lock);
+		}
+		spin_unlock_irq(&aii->i_lock);
+	}
+	spin_unlock(&asb->asmfs_lock);
+
+	return 0;
+}
+
+static int asmfs_contexts_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, asmfs_contexts_show,
+			   ASMFS_SB(inode->i_sb));
+}
+
+static struct file_operations asmfs_contexts_operations = {
+	.open		= asmfs_contexts_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * The asynchronous way in.  An aio read of an asm_ioc from the
+ * instance file submits it, and the completion event carries the
+ * result; see abi.h.  The request is never reaped through
+ * asm_do_io(), so the user's asm_ioc is left alone.
+ */
+static ssize_t asmfs_file_aio_read(struct kiocb *iocb,
+				   const struct iovec *iov,
+				   unsigned long nr_segs, loff_t pos)
+{
+	struct file *file = iocb->ki_filp;
+	asm_ioc __user *iocp;
+	asm_ioc tmp;
+	ssize_t ret;
+
+	mlog_entry("(0x%p, 0x%p, %lu)\n", iocb, iov, nr_segs);
+
+	/* readv() lands here too */
+	ret = -EINVAL;
+	if (is_sync_kiocb(iocb) || (nr_segs != 1))
+		goto out;
+
+	asm_cleanup_bios(file);
+
+	iocp = (asm_ioc __user *)iov[0].iov_base;
+	ret = -EFAULT;
+	if (iov[0].iov_len == sizeof(asm_ioc)) {
+		if (copy_from_user(&tmp, iocp, sizeof(asm_ioc)))
+			goto out;
+#if BITS_PER_LONG == 64
+	} else if (iov[0].iov_len == sizeof(asm_ioc32)) {
+		if (copy_from_user(&tmp, iocp, sizeof(asm_ioc32)))
+			goto out;
+		asm_promote_64(&tmp);
+#endif  /* BITS_PER_LONG == 64 */
+	} else {
+		ret = -EINVAL;
+		goto out;
 	}
 
+	mlog(ML_IOC, "Submitting user asm_ioc 0x%p for iocb 0x%p\n",
+	     iocp, iocb);
+	ret = asm_submit_io(file, iocp, &tmp, iocb);
+	if (!ret)
+		ret = -EIOCBQUEUED;
+
+out:
+	mlog_exit(ret);
 	return ret;
 }
 
@@ -2740,6 +5581,8 @@ static struct file_operations asmfs_file_operations = {
 	.open		= asmfs_file_open,
 	.release	= asmfs_file_release,
 	.read		= asmfs_file_read,
+	.aio_read	= asmfs_file_aio_read,
+	.poll		= asmfs_file_poll,
 };
 
 static struct inode_operations asmfs_file_inode_operations = {
@@ -2778,7 +5621,7 @@ static int asmfs_fill_super(struct super_block *sb,
 			    void *data, int silent)
 {
 	struct inode *inode, *parent;
-	struct dentry *root, *dentry;
+	struct dentry *root, *dentry, *iid_dir;
 	struct asmfs_sb_info *asb;
 	struct asmfs_params params;
 	struct qstr name;
@@ -2795,13 +5638,23 @@ static int asmfs_fill_super(struct super_block *sb,
 	sb->s_fs_info = asb;
 
 	asb->asmfs_super = sb;
-	asb->next_iid = 1;
+	asmfs_iid_init(asb);
 	spin_lock_init(&asb->asmfs_lock);
+	if (percpu_counter_init(&asb->used_inodes, 0)) {
+		sb->s_fs_info = NULL;
+		kfree(asb);
+		return -ENOMEM;
+	}
+	INIT_LIST_HEAD(&asb->asmfs_instances);
+
+	init_tunables(asb);
 
 	if (parse_options((char *)data, &params) != 0)
 		goto out_free_asb;
 
 	init_limits(asb, &params);
+	if (asmfs_apply_tunables(asb, &params))
+		goto out_free_asb;
 
 	inode = new_inode(sb);
 	if (!inode)
@@ -2867,6 +5720,43 @@ static int asmfs_fill_super(struct super_block *sb,
 	inode->i_fop = &asmfs_dir_operations;
 	inode->i_mapping->backing_dev_info = &memory_backing_dev_info;
 	d_add(dentry, inode);
+	iid_dir = dentry;
+
+	name.name = ASM_MANAGER_INSTANCE_STATS;
+	name.len = strlen(ASM_MANAGER_INSTANCE_STATS);
+	name.hash = full_name_hash(name.name, name.len);
+	dentry = d_alloc(iid_dir, &name);
+	if (!dentry)
+		goto out_genocide;
+	inode = new_inode(sb);
+	if (!inode)
+		goto out_genocide;
+	inode->i_ino = (unsigned long)inode;
+	inode->i_mode = S_IFREG | 0440;
+	inode->i_uid = GLOBAL_ROOT_UID;
+	inode->i_gid = GLOBAL_ROOT_GID;
+	inode->i_atime = inode->i_mtime = inode->i_ctime = CURRENT_TIME;
+	inode->i_fop = &asmfs_stats_operations;
+	inode->i_mapping->backing_dev_info = &memory_backing_dev_info;
+	d_add(dentry, inode);
+
+	name.name = ASM_MANAGER_INSTANCE_CONTEXTS;
+	name.len = strlen(ASM_MANAGER_INSTANCE_CONTEXTS);
+	name.hash = full_name_hash(name.name, name.len);
+	dentry = d_alloc(iid_dir, &name);
+	if (!dentry)
+		goto out_genocide;
+	inode = new_inode(sb);
+	if (!inode)
+		goto out_genocide;
+	inode->i_ino = (unsigned long)inode;
+	inode->i_mode = S_IFREG | 0440;
+	inode->i_uid = GLOBAL_ROOT_UID;
+	inode->i_gid = GLOBAL_ROOT_GID;
+	inode->i_atime = inode->i_mtime = inode->i_ctime = CURRENT_TIME;
+	inode->i_fop = &asmfs_contexts_operations;
+	inode->i_mapping->backing_dev_info = &memory_backing_dev_info;
+	d_add(dentry, inode);
 
 	name.name = asm_operation_files[ASMOP_QUERY_VERSION];
 	name.len = strlen(asm_operation_files[ASMOP_QUERY_VERSION]);
@@ -2926,6 +5816,11 @@ static int asmfs_fill_super(struct super_block *sb,
 	printk(KERN_DEBUG "ASM: oracleasmfs mounted with options: %s\n",
 	       data ? (char *)data : "<defaults>" );
 	printk(KERN_DEBUG "ASM:	maxinstances=%ld\n", asb->max_inodes);
+	printk(KERN_DEBUG "ASM:	maxdiskios=%d maxinstanceios=%d\n",
+	       asb->max_disk_ios, asb->max_instance_ios);
+	printk(KERN_DEBUG "ASM:	maxiops=%u maxmbps=%llu\n",
+	       asb->max_iops, (unsigned long long)(asb->max_bps >> 20));
+	asmfs_print_tunables(asb);
 	return 0;
 
 out_genocide:
@@ -2934,6 +5829,9 @@ out_genocide:
 
 out_free_asb:
 	sb->s_fs_info = NULL;
+	if (asb->reqpool)
+		mempool_destroy(asb->reqpool);
+	percpu_counter_destroy(&asb->used_inodes);
 	kfree(asb);
 
 	return -EINVAL;
@@ -3019,12 +5917,21 @@ static int __init init_asmfs_fs(void)
 		goto out_diskcache;
 	}
 
+	ret = -ENOMEM;
+	asm_nobuf_wq = create_workqueue("oracleasm");
+	if (!asm_nobuf_wq) {
+		printk("oracleasmfs: Unable to create workqueue\n");
+		goto out_workqueue;
+	}
+
 	ret = init_oracleasm_proc();
 	if (ret) {
 		printk("oracleasmfs: Unable to register proc entries\n");
 		goto out_proc;
 	}
 
+	asm_integrity_bench();
+
 	init_asmfs_dir_operations();
 	ret = register_filesystem(&asmfs_fs_type);
 	if (ret) {
@@ -3038,6 +5945,9 @@ out_register:
 	exit_oracleasm_proc();
 
 out_proc:
+	destroy_workqueue(asm_nobuf_wq);
+
+out_workqueue:
 	destroy_asmdiskcache();
 
 out_diskcache:
@@ -3054,6 +5964,7 @@ static void __exit exit_asmfs_fs(void)
 {
 	unregister_filesystem(&asmfs_fs_type);
 	exit_oracleasm_proc();
+	destroy_workqueue(asm_nobuf_wq);
 	destroy_asmdiskcache();
 	destroy_requestcache();
 	destroy_inodecache();
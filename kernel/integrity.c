@@ -30,10 +30,15 @@
  * General Public License for more details.
  */
 
+#include <linux/module.h>
+#include <linux/slab.h>
 #include <linux/pagemap.h>
 #include <linux/bio.h>
 #include <linux/blkdev.h>
 #include <linux/compat.h>
+#include <linux/crc-t10dif.h>
+#include <net/checksum.h>
+#include <asm/uaccess.h>
 
 #include "linux/oracleasm/compat32.h"
 #include "linux/oracleasm/kernel.h"
@@ -45,14 +50,64 @@
 #include "masklog.h"
 #include "integrity.h"
 
-u32 asm_integrity_format(struct block_device *bdev)
+static unsigned int soft_integrity = 0;
+module_param(soft_integrity, uint, 0644);
+MODULE_PARM_DESC(soft_integrity,
+	"Protect disks lacking an integrity profile in software, from their next open (0=off [default], 1=T10 CRC, 2=IP checksum).  If set at load, the guards' speed is logged");
+
+/*
+ * Block layer profile names we know how to drive.  sd registers Type 2
+ * disks under the Type 1 names, and Type 3 leaves the reference tag
+ * alone.
+ */
+static const struct {
+	const char	*name;
+	u32		flags;
+} asm_integrity_profiles[ASM_IPROF_NR] = {
+	[ASM_IPROF_TYPE1_CRC]	= { "T10-DIF-TYPE1-CRC", 0 },
+	[ASM_IPROF_TYPE1_IP]	= { "T10-DIF-TYPE1-IP", ASM_IFMT_IP_CHECKSUM },
+	[ASM_IPROF_TYPE3_CRC]	= { "T10-DIF-TYPE3-CRC", ASM_IFMT_NO_REFTAG },
+	[ASM_IPROF_TYPE3_IP]	= { "T10-DIF-TYPE3-IP",
+				    ASM_IFMT_IP_CHECKSUM | ASM_IFMT_NO_REFTAG },
+	[ASM_IPROF_SOFT_CRC]	= { NULL, ASM_IFMT_SOFTWARE },
+	[ASM_IPROF_SOFT_IP]	= { NULL,
+				    ASM_IFMT_IP_CHECKSUM | ASM_IFMT_SOFTWARE },
+};
+
+enum asm_integrity_profile asm_integrity_profile(struct block_device *bdev)
 {
 	struct blk_integrity *bi = bdev_get_integrity(bdev);
+	int i;
+
+	if (bi && bi->name) {
+		for (i = ASM_IPROF_NONE + 1; i < ASM_IPROF_NR; i++)
+			if (asm_integrity_profiles[i].name &&
+			    !strcmp(bi->name, asm_integrity_profiles[i].name))
+				return i;
+
+		/* Never second-guess a device that does its own checking */
+		return ASM_IPROF_NONE;
+	}
+
+	switch (soft_integrity) {
+		case 1:
+			return ASM_IPROF_SOFT_CRC;
+		case 2:
+			return ASM_IPROF_SOFT_IP;
+	}
+
+	return ASM_IPROF_NONE;
+} /* asm_integrity_profile */
+
+
+u32 asm_integrity_format(struct block_device *bdev)
+{
+	enum asm_integrity_profile prof = asm_integrity_profile(bdev);
 	unsigned int lbs = bdev_logical_block_size(bdev);
 	unsigned int pbs = bdev_physical_block_size(bdev);
 	unsigned int format = 0;
 
-	if (!bi)
+	if (prof == ASM_IPROF_NONE)
 		return 0;
 
 	if (lbs == 512 && pbs == 512)
@@ -64,35 +119,26 @@ u32 asm_integrity_format(struct block_device *bdev)
 	else
 		return 0;
 
-	if (!strcmp(bi->name, "T10-DIF-TYPE1-CRC"))
-		return format;
-
-	if (!strcmp(bi->name, "T10-DIF-TYPE1-IP"))
-		return format | ASM_IFMT_IP_CHECKSUM;
-
-	return 0;
+	return format | asm_integrity_profiles[prof].flags;
 } /* asm_integrity_format */
 
 
-int asm_integrity_check(struct oracleasm_integrity_v2 *it, struct block_device *bdev)
+/*
+ * @format is the disk's format masked with ASM_INTEGRITY_IOC_MASK, as
+ * cached when the disk was opened.
+ */
+int asm_integrity_check(struct oracleasm_integrity_v2 *it, u8 format,
+			struct block_device *bdev)
 {
-	unsigned int dev_format;
-
-	/* Strip feature flags */
-	dev_format = asm_integrity_format(bdev) & ASM_INTEGRITY_HANDLE_MASK;
-
-	if (!dev_format)
-		return 0;
-
 	if (it->it_magic != ASM_INTEGRITY_MAGIC) {
 		mlog(ML_ERROR|ML_IOC, "IOC integrity: Bad magic...\n");
 		return -EINVAL;
 	}
 
-	if (it->it_format != dev_format) {
+	if (it->it_format != format) {
 		mlog(ML_ERROR|ML_IOC,
 		     "IOC integrity: incorrect format for %s (%u != %u)\n",
-		     bdev->bd_disk->disk_name, it->it_format, dev_format);
+		     bdev->bd_disk->disk_name, it->it_format, format);
 		return -EINVAL;
 	}
 
@@ -112,6 +158,13 @@ int asm_integrity_check(struct oracleasm_integrity_v2 *it, struct block_device *
 } /* asm_integrity_check */
 
 
+/*
+ * it_bytes is 16 bits wide, so a protection buffer can never span more
+ * than this many pages.  That lets the page vector live on the stack
+ * instead of being allocated for every protected I/O.
+ */
+#define ASM_INTEGRITY_MAX_PAGES	(DIV_ROUND_UP(USHRT_MAX, PAGE_SIZE) + 1)
+
 int asm_integrity_map(struct oracleasm_integrity_v2 *it, struct asm_request *r, int write_to_vm)
 {
 	int len = it->it_bytes;
@@ -123,18 +176,27 @@ int asm_integrity_map(struct oracleasm_integrity_v2 *it, struct asm_request *r,
 	int i, ret;
 	struct bio *bio = r->r_bio;
 	struct bio_integrity_payload *bip;
-	struct page **pages;
-
-	ret = 0;
+	struct page *pages[ASM_INTEGRITY_MAX_PAGES];
 
-	if (nr_pages < 1) {
-		mlog(ML_ERROR, "%s: nr_pages < 1\n", __func__);
+	if (nr_pages < 1 || nr_pages > ASM_INTEGRITY_MAX_PAGES) {
+		mlog(ML_ERROR, "%s: bad nr_pages %u\n", __func__, nr_pages);
 		return -EINVAL;
 	}
 
+	/* Pin first, so that a fault leaves nothing hanging off the bio */
+	ret = get_user_pages_fast(uaddr, nr_pages, write_to_vm, &pages[0]);
+	if (ret < (int)nr_pages) {
+		mlog(ML_ERROR, "%s: could not get user pages\n", __func__);
+		for (i = 0; i < ret; i++)
+			page_cache_release(pages[i]);
+		return -EFAULT;
+	}
+
 	bip = bio_integrity_alloc(bio, GFP_NOIO, nr_pages);
 	if (!bip) {
 		mlog(ML_ERROR, "%s: could not allocate bip\n", __func__);
+		for (i = 0; i < nr_pages; i++)
+			page_cache_release(pages[i]);
 		return -ENOMEM;
 	}
 
@@ -146,22 +208,13 @@ int asm_integrity_map(struct oracleasm_integrity_v2 *it, struct asm_request *r,
 	if (it->it_flags & ASM_IFLAG_REMAPPED)
 		bio->bi_flags |= 1 << BIO_MAPPED_INTEGRITY;
 
-	pages = kcalloc(nr_pages, sizeof(struct page *), GFP_KERNEL);
-	if (!pages) {
-		mlog(ML_ERROR, "%s: could not allocate page array\n", __func__);
-		return -ENOMEM;
-	}
-
-	ret = get_user_pages_fast(uaddr, nr_pages, write_to_vm, &pages[0]);
-	if (ret < nr_pages) {
-		mlog(ML_ERROR, "%s: could not get user pages\n", __func__);
-		kfree(pages);
-		return -EFAULT;
-	}
-
 	offset = offset_in_page(it->it_buf);
 	ret = 0;
 
+	/*
+	 * Pages handed to the bip are released by asm_integrity_unmap();
+	 * only the ones we fail to attach are dropped here.
+	 */
 	for (i = 0 ; i < nr_pages ; i++) {
 		unsigned int bytes = PAGE_SIZE - offset;
 		unsigned int added;
@@ -175,7 +228,7 @@ int asm_integrity_map(struct oracleasm_integrity_v2 *it, struct asm_request *r,
 		added = bio_integrity_add_page(bio, pages[i], bytes, offset);
 
 		if (added < bytes) {
-			ret = -1;
+			ret = -ENOMEM;
 			mlog(ML_ERROR, "%s: bio %p added %u bytes, wanted %u\n",
 			     __func__, bio, added, bytes);
 			break;
@@ -188,9 +241,7 @@ int asm_integrity_map(struct oracleasm_integrity_v2 *it, struct asm_request *r,
 	while (i < nr_pages)
 		page_cache_release(pages[i++]);
 
-	kfree(pages);
-
-	if (bio->bi_integrity->bip_vcnt == 0)
+	if (!ret && bio->bi_integrity->bip_vcnt == 0)
 		ret = -EINVAL;
 
 	return ret;
@@ -214,7 +265,303 @@ void asm_integrity_unmap(struct bio *bio)
 } /* asm_integrity_unmap */
 
 
-unsigned int asm_integrity_error(struct asm_request *r)
+/*
+ * Tuple checking, shared by software integrity and by the decoding of
+ * device integrity errors.  The tuples look exactly as they would for
+ * a Type 1 device: the guard covers one logical block and the ref tag
+ * is the block's offset from the start of the bdev.  An app tag of
+ * 0xffff disables checking for that tuple, as it does for T10.
+ *
+ * crc_t10dif() picks up the PCLMULQDQ implementation on kernels that
+ * have one; ip_compute_csum() is the architecture's csum_partial().
+ */
+static inline __be16 asm_pi_guard(u8 profile, void *data, unsigned int len)
+{
+	if (asm_integrity_profiles[profile].flags & ASM_IFMT_IP_CHECKSUM)
+		return (__force __be16)ip_compute_csum(data, len);
+
+	return cpu_to_be16(crc_t10dif(data, len));
+}
+
+/* The walk below needs every interval to sit inside one bvec */
+static int asm_pi_aligned(struct bio *bio, unsigned int interval)
+{
+	struct bio_vec *bv;
+	int i;
+
+	__bio_for_each_segment(bv, bio, i, 0) {
+		if ((bv->bv_offset | bv->bv_len) & (interval - 1))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Generate (@verify == 0) or check up to @nr tuples against the data
+ * of @bio.  A ref tag matching either @ref or @alt_ref counts, which
+ * lets a device failure be checked whichever way the tags were last
+ * remapped.  On a mismatch, *@detail gets the edetail_asm_ioc value,
+ * which counts in ASM blocks of 1 << @bshift bytes.  Only ever called
+ * from process context.
+ */
+static int asm_pi_walk(struct bio *bio, u8 profile, unsigned int shift,
+		       unsigned int bshift, u32 ref, u32 alt_ref,
+		       struct asm_pi_tuple *pi, unsigned int nr, int verify,
+		       u32 *detail)
+{
+	u32 pflags = asm_integrity_profiles[profile].flags;
+	unsigned int interval = 1 << shift;
+	unsigned int tag = ASM_ITAG_UNKNOWN;
+	struct bio_vec *bv;
+	char *buf;
+	unsigned int j;
+	u32 n = 0;
+	int i;
+
+	__bio_for_each_segment(bv, bio, i, 0) {
+		buf = kmap(bv->bv_page) + bv->bv_offset;
+
+		for (j = 0; j < bv->bv_len && n < nr;
+		     j += interval, pi++, n++) {
+			__be16 guard = asm_pi_guard(profile, buf + j, interval);
+			u32 pt_ref;
+
+			if (!verify) {
+				pi->pt_guard = guard;
+				pi->pt_app = 0;
+				pi->pt_ref = cpu_to_be32(ref + n);
+				continue;
+			}
+
+			if (pi->pt_app == cpu_to_be16(0xffff))
+				continue;
+
+			if (pi->pt_guard != guard) {
+				mlog(ML_ERROR|ML_BIO,
+				     "bio 0x%p: guard tag mismatch at block %u (0x%04x != 0x%04x)\n",
+				     bio, n, be16_to_cpu(pi->pt_guard),
+				     be16_to_cpu(guard));
+				tag = ASM_ITAG_GUARD;
+				break;
+			}
+
+			pt_ref = be32_to_cpu(pi->pt_ref);
+			if (!(pflags & ASM_IFMT_NO_REFTAG) &&
+			    pt_ref != ref + n && pt_ref != alt_ref + n) {
+				mlog(ML_ERROR|ML_BIO,
+				     "bio 0x%p: ref tag mismatch at block %u (%u != %u)\n",
+				     bio, n, pt_ref, ref + n);
+				tag = ASM_ITAG_REF;
+				break;
+			}
+		}
+
+		kunmap(bv->bv_page);
+
+		if (tag != ASM_ITAG_UNKNOWN)
+			break;
+	}
+
+	if (tag == ASM_ITAG_UNKNOWN)
+		return 0;
+
+	*detail = (tag << ASM_EDETAIL_TAG_SHIFT) |
+		((n >> (bshift - shift)) & ASM_EDETAIL_OFFSET_MASK);
+	return -EILSEQ;
+} /* asm_pi_walk */
+
+
+/*
+ * The block layer turns every protection failure into -EILSEQ, so
+ * find the culprit by checking the tuples ourselves.  For a write,
+ * that is what the device objected to.  For a read, it is whatever
+ * the device returned before failing; best effort.  Runs from the
+ * request's work item, as it means another pass over the data.
+ */
+static u32 asm_integrity_decode(struct bio *bio, struct block_device *bdev,
+				u8 profile, unsigned int bshift)
 {
+	struct bio_integrity_payload *bip = bio->bi_integrity;
+	unsigned int shift = blksize_bits(bdev_logical_block_size(bdev));
+	struct bio_vec *iv;
+	unsigned int len = 0;
+	char *pi, *buf;
+	u32 virt, detail = 0;
+	int i;
+
+	if (!asm_pi_aligned(bio, 1 << shift))
+		return 0;
+
+	__bip_for_each_vec(iv, bip, i, 0)
+		len += iv->bv_len;
+
+	/* Tuples may straddle the caller's pages, so flatten them */
+	pi = kmalloc(len, GFP_NOIO);
+	if (!pi)
+		return 0;
+
+	len = 0;
+	__bip_for_each_vec(iv, bip, i, 0) {
+		buf = kmap(iv->bv_page);
+		memcpy(pi + len, buf + iv->bv_offset, iv->bv_len);
+		kunmap(iv->bv_page);
+		len += iv->bv_len;
+	}
+
+	virt = bip->bip_sector >> (shift - 9);
+	asm_pi_walk(bio, profile, shift, bshift, virt,
+		    virt + (get_start_sect(bdev) >> (shift - 9)),
+		    (struct asm_pi_tuple *)pi,
+		    len / sizeof(struct asm_pi_tuple), 1, &detail);
+
+	kfree(pi);
+
+	return detail;
+} /* asm_integrity_decode */
+
+
+unsigned int asm_integrity_error(struct asm_request *r,
+				 struct block_device *bdev, u8 profile,
+				 unsigned int bshift)
+{
+	/* Software integrity fills the detail in as it checks */
+	if (!r->r_edetail && r->r_bio && bdev &&
+	    bio_flagged(r->r_bio, BIO_FS_INTEGRITY))
+		r->r_edetail = asm_integrity_decode(r->r_bio, bdev, profile,
+						    bshift);
+
 	return ASM_ERR_INTEGRITY;
+} /* asm_integrity_error */
+
+
+/*
+ * Software integrity.  Writes are checked here, before the bio is
+ * submitted.  Reads get a buffer that asm_integrity_soft_complete()
+ * fills in from a work item once the bio is back, and that is copied
+ * out when the request is reaped.
+ */
+int asm_integrity_soft_map(struct oracleasm_integrity_v2 *it,
+			   struct asm_request *r,
+			   enum asm_integrity_profile profile,
+			   unsigned int bshift, int write)
+{
+	struct bio *bio = r->r_bio;
+	unsigned int shift = blksize_bits(bdev_logical_block_size(bio->bi_bdev));
+	unsigned int nr = r->r_count >> shift;
+	struct asm_soft_pi *sp;
+	int ret;
+
+	if (it->it_bytes != nr * sizeof(struct asm_pi_tuple)) {
+		mlog(ML_ERROR|ML_IOC,
+		     "IOC integrity: buffer is %u bytes, need %zu\n",
+		     it->it_bytes, nr * sizeof(struct asm_pi_tuple));
+		return -EINVAL;
+	}
+
+	if (!asm_pi_aligned(bio, 1 << shift)) {
+		mlog(ML_ERROR|ML_IOC,
+		     "IOC integrity: buffer not aligned to %u bytes\n",
+		     1 << shift);
+		return -EINVAL;
+	}
+
+	sp = kmalloc(sizeof(*sp) + it->it_bytes, GFP_KERNEL);
+	if (!sp)
+		return -ENOMEM;
+
+	sp->sp_user = (void __user *)(unsigned long)it->it_buf;
+	sp->sp_bytes = it->it_bytes;
+	sp->sp_ref = bio->bi_sector >> (shift - 9);
+	sp->sp_profile = profile;
+	sp->sp_shift = shift;
+
+	if (!write) {
+		r->r_pi = sp;
+		return 0;
+	}
+
+	if (copy_from_user(sp->sp_tuples, sp->sp_user, sp->sp_bytes))
+		ret = -EFAULT;
+	else
+		ret = asm_pi_walk(bio, profile, shift, bshift, sp->sp_ref,
+				  sp->sp_ref, sp->sp_tuples, nr, 1,
+				  &r->r_edetail);
+
+	kfree(sp);
+
+	return ret;
+} /* asm_integrity_soft_map */
+
+
+void asm_integrity_soft_complete(struct asm_request *r)
+{
+	struct asm_soft_pi *sp = r->r_pi;
+
+	asm_pi_walk(r->r_bio, sp->sp_profile, sp->sp_shift, sp->sp_shift,
+		    sp->sp_ref, sp->sp_ref, sp->sp_tuples,
+		    sp->sp_bytes / sizeof(struct asm_pi_tuple), 0, NULL);
+} /* asm_integrity_soft_complete */
+
+
+int asm_integrity_soft_copyout(struct asm_soft_pi *sp)
+{
+	if (copy_to_user(sp->sp_user, sp->sp_tuples, sp->sp_bytes))
+		return -EFAULT;
+
+	return 0;
+} /* asm_integrity_soft_copyout */
+
+
+/*
+ * Guard throughput, measured at load when soft_integrity is set, so
+ * the cost of software integrity can be read off the log of the
+ * machine it runs on.  As with the kernel's xor calibration: as many
+ * passes over a page as fit in a few jiffies.
+ */
+#define ASM_PI_BENCH_JIFFIES	((HZ / 50) + 1)
+
+static __be16 asm_pi_bench_sink;
+
+static unsigned int asm_pi_speed(u8 profile, void *buf)
+{
+	unsigned long now, end;
+	u64 bytes = 0;
+
+	/* Start on a jiffy boundary */
+	now = jiffies;
+	while (jiffies == now)
+		cpu_relax();
+	end = jiffies + ASM_PI_BENCH_JIFFIES;
+
+	while (time_before(jiffies, end)) {
+		ACCESS_ONCE(asm_pi_bench_sink) =
+			asm_pi_guard(profile, buf, PAGE_SIZE);
+		bytes += PAGE_SIZE;
+	}
+
+	/* MB/s */
+	bytes *= HZ;
+	do_div(bytes, ASM_PI_BENCH_JIFFIES);
+	return (unsigned int)(bytes >> 20);
 }
+
+void asm_integrity_bench(void)
+{
+	unsigned long page;
+
+	if (!soft_integrity)
+		return;
+
+	page = __get_free_page(GFP_KERNEL);
+	if (!page)
+		return;
+	memset((void *)page, 0x5a, PAGE_SIZE);
+
+	printk(KERN_INFO
+	       "ASM: software integrity guard: crc %u MB/s, ip %u MB/s\n",
+	       asm_pi_speed(ASM_IPROF_SOFT_CRC, (void *)page),
+	       asm_pi_speed(ASM_IPROF_SOFT_IP, (void *)page));
+
+	free_page(page);
+} /* asm_integrity_bench */
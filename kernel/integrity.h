@@ -1,21 +1,65 @@
 #ifndef ASM_INTEGRITY_H
 #define ASM_INTEGRITY_H
 
+/* Protection profiles, resolved once per disk when it is opened */
+enum asm_integrity_profile {
+	ASM_IPROF_NONE = 0,
+	ASM_IPROF_TYPE1_CRC,
+	ASM_IPROF_TYPE1_IP,
+	ASM_IPROF_TYPE3_CRC,
+	ASM_IPROF_TYPE3_IP,
+	ASM_IPROF_SOFT_CRC,		/* No device profile, see soft_integrity */
+	ASM_IPROF_SOFT_IP,
+	ASM_IPROF_NR,
+};
+
+#define asm_integrity_is_soft(p)	((p) >= ASM_IPROF_SOFT_CRC)
+
+/* 8-byte T10 protection tuple, as laid out in the caller's buffer */
+struct asm_pi_tuple {
+	__be16 pt_guard;
+	__be16 pt_app;
+	__be32 pt_ref;
+};
+
+/* Tuples generated for a software-protected read, until it is reaped */
+struct asm_soft_pi {
+	void __user *sp_user;
+	unsigned int sp_bytes;
+	u32 sp_ref;			/* Ref tag of the first interval */
+	u8 sp_profile;
+	u8 sp_shift;			/* Interval size */
+	struct asm_pi_tuple sp_tuples[0];
+};
+
 #if defined(CONFIG_BLK_DEV_INTEGRITY)
 
+#define asm_integrity_mapped(bio)	bio_flagged((bio), BIO_FS_INTEGRITY)
+
+extern enum asm_integrity_profile asm_integrity_profile(struct block_device *);
 extern u32  asm_integrity_format(struct block_device *);
-extern int  asm_integrity_check(struct oracleasm_integrity_v2 *, struct block_device *);
+extern int  asm_integrity_check(struct oracleasm_integrity_v2 *, u8, struct block_device *);
 extern int  asm_integrity_map(struct oracleasm_integrity_v2 *, struct asm_request *, int);
 extern void asm_integrity_unmap(struct bio *);
-extern unsigned int asm_integrity_error(struct asm_request *);
+extern unsigned int asm_integrity_error(struct asm_request *, struct block_device *, u8, unsigned int);
+extern int  asm_integrity_soft_map(struct oracleasm_integrity_v2 *, struct asm_request *, enum asm_integrity_profile, unsigned int, int);
+extern void asm_integrity_soft_complete(struct asm_request *);
+extern int  asm_integrity_soft_copyout(struct asm_soft_pi *);
+extern void asm_integrity_bench(void);
 
 #else  /* CONFIG_BLK_DEV_INTEGRITY */
 
+#define asm_integrity_mapped(a)		(0)
+#define asm_integrity_profile(a)	(ASM_IPROF_NONE)
 #define asm_integrity_format(a)		(0)
-#define asm_integrity_check(a, b)	(0)
+#define asm_integrity_check(a, b, c)	(0)
 #define asm_integrity_map(a, b, c)	(0)
 #define asm_integrity_unmap(a)		do { } while (0)
-#define asm_integrity_error(a)		(ASM_ERR_IO)
+#define asm_integrity_error(a, b, c, d)	(ASM_ERR_IO)
+#define asm_integrity_soft_map(a, b, c, d, e)	(-EINVAL)
+#define asm_integrity_soft_complete(a)	do { } while (0)
+#define asm_integrity_soft_copyout(a)	(0)
+#define asm_integrity_bench()		do { } while (0)
 
 #endif	/* CONFIG_BLK_DEV_INTEGRITY */
 
@@ -24,13 +24,45 @@
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/string.h>
+#include <linux/mutex.h>
 #include <asm/uaccess.h>
 
 #include "masklog.h"
 
+#ifdef MLOG_USE_TRACE
+#include <linux/ring_buffer.h>
+#include <linux/slab.h>
+#include <linux/time.h>
+#include <asm/div64.h>
+#endif
+
 struct mlog_bits mlog_and_bits = MLOG_BITS_RHS(MLOG_INITIAL_AND_MASK);
 struct mlog_bits mlog_not_bits = MLOG_BITS_RHS(MLOG_INITIAL_NOT_MASK);
 
+#if defined(STATIC_KEY) || defined(JUMP_LABEL_KEY)
+/* All off, matching the debugging bits of MLOG_INITIAL_AND_MASK */
+mlog_key_t mlog_keys[MLOG_MAX_BITS];
+
+/* Keep each key in step with its bit in mlog_and_bits */
+static void mlog_update_key(int bit, int was_allowed)
+{
+	int allowed = !!__mlog_test_u64((u64)1 << bit, mlog_and_bits);
+
+	if (allowed == was_allowed)
+		return;
+
+	if (allowed)
+		mlog_key_inc(&mlog_keys[bit]);
+	else
+		mlog_key_dec(&mlog_keys[bit]);
+}
+#else
+#define mlog_update_key(bit, was_allowed)	do { } while (0)
+#endif
+
+/* Serializes writers, since the key updates can sleep */
+static DEFINE_MUTEX(mlog_mask_mutex);
+
 static char *mlog_bit_names[MLOG_MAX_BITS];
 
 static void *mlog_name_from_pos(loff_t *caller_pos)
@@ -96,6 +128,7 @@ static ssize_t mlog_fop_write(struct file *filp, const char __user *buf,
 	char *name;
 	char str[32], *mask, *val;
 	unsigned i, masklen, namelen;
+	int was_allowed;
 
 	if (count == 0)
 		return 0;
@@ -137,6 +170,9 @@ static ssize_t mlog_fop_write(struct file *filp, const char __user *buf,
 	if (i == ARRAY_SIZE(mlog_bit_names))
 		return -EINVAL;
 
+	mutex_lock(&mlog_mask_mutex);
+	was_allowed = !!__mlog_test_u64((u64)1 << i, mlog_and_bits);
+
 	if (!strnicmp(val, "allow", 5)) {
 		__mlog_set_u64((u64)1 << i, mlog_and_bits);
 		__mlog_clear_u64((u64)1 << i, mlog_not_bits);
@@ -146,8 +182,13 @@ static ssize_t mlog_fop_write(struct file *filp, const char __user *buf,
 	} else if (!strnicmp(val, "off", 3)) {
 		__mlog_clear_u64((u64)1 << i, mlog_not_bits);
 		__mlog_clear_u64((u64)1 << i, mlog_and_bits);
-	} else
+	} else {
+		mutex_unlock(&mlog_mask_mutex);
 		return -EINVAL;
+	}
+
+	mlog_update_key(i, was_allowed);
+	mutex_unlock(&mlog_mask_mutex);
 
 	*pos += count;
 	return count;
@@ -162,6 +203,208 @@ static struct file_operations mlog_seq_fops = {
 	.release = seq_release,
 };
 
+#ifdef MLOG_USE_TRACE
+static unsigned long trace_buffer_size = 128 * 1024;
+module_param(trace_buffer_size, ulong, 0444);
+MODULE_PARM_DESC(trace_buffer_size,
+	"Bytes of debugging trace kept per CPU (default 128KB)");
+
+/*
+ * The ring buffer keeps the newest events, overwriting the oldest, so
+ * it always holds the run-up to whatever is being chased.  Writers
+ * never take a lock; readers consume events in timestamp order.
+ */
+static struct ring_buffer *mlog_trace_buffer;
+static DEFINE_MUTEX(mlog_trace_mutex);
+
+/*
+ * The format and function name live with the module, which outlives
+ * the buffer.  String arguments are copied into te_args by
+ * vbin_printf().
+ */
+struct mlog_trace_entry {
+	pid_t		te_pid;
+	int		te_line;
+	const char	*te_func;	/* __PRETTY_FUNCTION__ */
+	const char	*te_fmt;
+	u32		te_args[0];	/* As packed by vbin_printf() */
+};
+
+#define MLOG_TRACE_ARGS_MAX	40	/* u32s, strings included */
+#define MLOG_TRACE_MSG_MAX	160
+#define MLOG_TRACE_LINE_MAX	(MLOG_TRACE_MSG_MAX + 128)
+
+void mlog_trace(const char *func, int line, const char *fmt, ...)
+{
+	struct ring_buffer *buffer = mlog_trace_buffer;
+	struct ring_buffer_event *event;
+	struct mlog_trace_entry *te;
+	u32 bin[MLOG_TRACE_ARGS_MAX];
+	char msg[MLOG_TRACE_MSG_MAX];
+	va_list args;
+	int len;
+
+	if (!buffer) {
+		va_start(args, fmt);
+		vscnprintf(msg, sizeof(msg), fmt, args);
+		va_end(args);
+		printk(KERN_INFO "(%u,%lu):%s:%d %s", current->pid,
+		       __mlog_cpu_guess, func, line, msg);
+		return;
+	}
+
+	va_start(args, fmt);
+	len = vbin_printf(bin, MLOG_TRACE_ARGS_MAX, fmt, args);
+	va_end(args);
+	/* Truncated arguments would send bstr_printf() off the end */
+	if (len > MLOG_TRACE_ARGS_MAX) {
+		fmt = "(arguments too long to trace)\n";
+		len = 0;
+	}
+
+	/* A failed reserve shows up as lost events on the reader side */
+	event = ring_buffer_lock_reserve(buffer,
+					 sizeof(*te) + len * sizeof(u32));
+	if (!event)
+		return;
+
+	te = ring_buffer_event_data(event);
+	te->te_pid = current->pid;
+	te->te_line = line;
+	te->te_func = func;
+	te->te_fmt = fmt;
+	memcpy(te->te_args, bin, len * sizeof(u32));
+
+	ring_buffer_unlock_commit(buffer, event);
+}
+
+/* Format the oldest event across all CPUs, returning its CPU or -1 */
+static int mlog_trace_peek(char *line, int *len)
+{
+	struct ring_buffer_event *event, *next = NULL;
+	struct mlog_trace_entry *te;
+	unsigned long lost, next_lost = 0;
+	u64 ts, next_ts = 0;
+	unsigned long usecs;
+	char msg[MLOG_TRACE_MSG_MAX];
+	int cpu, next_cpu = -1;
+
+	for_each_possible_cpu(cpu) {
+		event = ring_buffer_peek(mlog_trace_buffer, cpu, &ts, &lost);
+		if (event && (!next || ts < next_ts)) {
+			next = event;
+			next_ts = ts;
+			next_lost = lost;
+			next_cpu = cpu;
+		}
+	}
+
+	if (!next)
+		return -1;
+
+	*len = 0;
+	if (next_lost)
+		*len = scnprintf(line, MLOG_TRACE_LINE_MAX,
+				 "[%d] lost %lu events\n", next_cpu,
+				 next_lost);
+
+	te = ring_buffer_event_data(next);
+	bstr_printf(msg, sizeof(msg), te->te_fmt, te->te_args);
+	usecs = do_div(next_ts, NSEC_PER_SEC) / NSEC_PER_USEC;
+	*len += scnprintf(line + *len, MLOG_TRACE_LINE_MAX - *len,
+			  "[%d] %llu.%06lu (%u):%s:%d %s", next_cpu,
+			  (unsigned long long)next_ts, usecs, te->te_pid,
+			  te->te_func, te->te_line, msg);
+
+	return next_cpu;
+}
+
+/*
+ * Reads consume whole lines.  One that does not fit is left for the
+ * next read, and a read too short for even the first line fails with
+ * -EINVAL.
+ */
+static ssize_t mlog_trace_read(struct file *file, char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	char *line;
+	ssize_t done = 0;
+	int cpu, len;
+
+	line = kmalloc(MLOG_TRACE_LINE_MAX, GFP_KERNEL);
+	if (!line)
+		return -ENOMEM;
+
+	mutex_lock(&mlog_trace_mutex);
+	while (done < count) {
+		cpu = mlog_trace_peek(line, &len);
+		if (cpu < 0)
+			break;
+
+		if (len > count - done) {
+			if (!done)
+				done = -EINVAL;
+			break;
+		}
+
+		if (copy_to_user(buf + done, line, len)) {
+			if (!done)
+				done = -EFAULT;
+			break;
+		}
+
+		ring_buffer_consume(mlog_trace_buffer, cpu, NULL, NULL);
+		done += len;
+	}
+	mutex_unlock(&mlog_trace_mutex);
+
+	kfree(line);
+
+	return done;
+}
+
+static struct file_operations mlog_trace_fops = {
+	.owner = THIS_MODULE,
+	.read = mlog_trace_read,
+};
+
+#define TRACE_PROC_NAME "trace"
+
+static int mlog_trace_init(struct proc_dir_entry *parent)
+{
+	struct proc_dir_entry *p;
+
+	mlog_trace_buffer = ring_buffer_alloc(trace_buffer_size,
+					      RB_FL_OVERWRITE);
+	if (!mlog_trace_buffer)
+		return -ENOMEM;
+
+	p = create_proc_entry(TRACE_PROC_NAME, S_IRUSR, parent);
+	if (p == NULL) {
+		ring_buffer_free(mlog_trace_buffer);
+		mlog_trace_buffer = NULL;
+		return -ENOMEM;
+	}
+
+	p->proc_fops = &mlog_trace_fops;
+
+	return 0;
+}
+
+static void mlog_trace_exit(struct proc_dir_entry *parent)
+{
+	struct ring_buffer *buffer = mlog_trace_buffer;
+
+	remove_proc_entry(TRACE_PROC_NAME, parent);
+	mlog_trace_buffer = NULL;
+	synchronize_sched();
+	ring_buffer_free(buffer);
+}
+#else
+#define mlog_trace_init(parent)		(0)
+#define mlog_trace_exit(parent)		do { } while (0)
+#endif  /* MLOG_USE_TRACE */
+
 #define set_a_string(which) do {					\
 	struct mlog_bits _bits = {{0,}, };				\
 	int _bit;							\
@@ -174,6 +417,7 @@ static struct file_operations mlog_seq_fops = {
 
 void mlog_remove_proc(struct proc_dir_entry *parent)
 {
+	mlog_trace_exit(parent);
 	remove_proc_entry(LOGMASK_PROC_NAME, parent);
 }
 
@@ -198,5 +442,10 @@ int mlog_init_proc(struct proc_dir_entry *parent)
 
 	p->proc_fops = &mlog_seq_fops;
 
+	if (mlog_trace_init(parent)) {
+		remove_proc_entry(LOGMASK_PROC_NAME, parent);
+		return -ENOMEM;
+	}
+
 	return 0;
 }
@@ -43,7 +43,8 @@
  * _ERROR and _NOTICE are used for messages that always go to the console and
  * have appropriate KERN_ prefixes.  We wrap these in our function instead of
  * just calling printk() so that this can eventually make its way through
- * relayfs along with the debugging messages.  Everything else gets KERN_DEBUG.
+ * relayfs along with the debugging messages.  Everything else goes to the
+ * trace ring buffer where the kernel has one, and gets KERN_INFO otherwise.
  * The inline tests and macro dance give GCC the opportunity to quite cleverly
  * only emit the appropriage printk() when the caller passes in a constant
  * mask, as is almost always the case.
@@ -138,6 +139,51 @@ extern struct mlog_bits mlog_and_bits, mlog_not_bits;
 
 #endif
 
+/*
+ * The debugging bits are almost always off, yet mlog_entry()/mlog_exit()
+ * sit on every I/O path.  Where the kernel has jump labels, each
+ * debugging bit gets a static key that is enabled while the bit is in
+ * mlog_and_bits, and a message whose bits are all disabled costs a nop.
+ * Only when a key is on do we fall through to the mask tests above,
+ * which still decide on the deny bits.  ERROR and NOTICE messages are
+ * on cold paths and are on by default, so they skip the keys and go
+ * straight to the mask tests.
+ */
+#if defined(STATIC_KEY) || defined(JUMP_LABEL_KEY)
+#include <linux/jump_label.h>
+#include <linux/log2.h>
+
+#ifdef STATIC_KEY
+#define mlog_key_t		struct static_key
+#define mlog_key_enabled(k)	static_key_false(k)
+#define mlog_key_inc(k)		static_key_slow_inc(k)
+#define mlog_key_dec(k)		static_key_slow_dec(k)
+#else
+#define mlog_key_t		struct jump_label_key
+#define mlog_key_enabled(k)	static_branch(k)
+#define mlog_key_inc(k)		jump_label_inc(k)
+#define mlog_key_dec(k)		jump_label_dec(k)
+#endif
+
+extern mlog_key_t mlog_keys[MLOG_MAX_BITS];
+
+#define __mlog_key(mask, bit)						\
+	(((mask) & (bit)) && mlog_key_enabled(&mlog_keys[ilog2(bit)]))
+
+/* NOTE: If you add a flag, you need to add it here too! */
+#define __mlog_key_test(mask)						\
+	(((mask) & (ML_ERROR|ML_NOTICE)) ||				\
+	 __mlog_key(mask, ML_ENTRY) || __mlog_key(mask, ML_EXIT) ||	\
+	 __mlog_key(mask, ML_DISK) || __mlog_key(mask, ML_REQUEST) ||	\
+	 __mlog_key(mask, ML_BIO) || __mlog_key(mask, ML_IOC) ||	\
+	 __mlog_key(mask, ML_ABI))
+
+#else  /* !STATIC_KEY && !JUMP_LABEL_KEY */
+
+#define __mlog_key_test(mask)	(1)
+
+#endif  /* STATIC_KEY || JUMP_LABEL_KEY */
+
 /*
  * smp_processor_id() "helpfully" screams when called outside preemptible
  * regions in current kernels.  sles doesn't have the variants that don't
@@ -159,7 +205,27 @@ extern struct mlog_bits mlog_and_bits, mlog_not_bits;
 	       __mlog_cpu_guess, __PRETTY_FUNCTION__, __LINE__ ,	\
 	       ##args)
 
-#define mlog(mask, fmt, args...) do {					\
+/*
+ * Debugging messages go to a per-CPU ring buffer that is read back
+ * through /proc/fs/oracleasm/trace, so that tracing can stay on under
+ * load without serializing on the console.  Only the format and the
+ * binary arguments are recorded; the text is made when it is read.
+ * ERROR and NOTICE messages still go to printk.
+ */
+#if defined(MLOG_TRACE) && defined(CONFIG_RING_BUFFER) && \
+	defined(CONFIG_BINARY_PRINTF)
+#define MLOG_USE_TRACE
+extern void mlog_trace(const char *func, int line, const char *fmt, ...)
+	__attribute__ ((format (printf, 3, 4)));
+#define __mlog_debug(fmt, args...)					\
+	mlog_trace(__PRETTY_FUNCTION__, __LINE__, fmt , ##args)
+#else
+#define __mlog_debug(fmt, args...)					\
+	__mlog_printk(KERN_INFO, fmt , ##args)
+#endif
+
+/* The mask tests alone, for callers that have already passed the keys */
+#define __mlog(mask, fmt, args...) do {					\
 	u64 __m = MLOG_MASK_PREFIX | (mask);				\
 	if (__mlog_test_u64(__m, mlog_and_bits) &&			\
 	    !__mlog_test_u64(__m, mlog_not_bits)) {			\
@@ -167,10 +233,15 @@ extern struct mlog_bits mlog_and_bits, mlog_not_bits;
 			__mlog_printk(KERN_ERR, "ERROR: "fmt , ##args);	\
 		else if (__m & ML_NOTICE)				\
 			__mlog_printk(KERN_NOTICE, fmt , ##args);	\
-		else __mlog_printk(KERN_INFO, fmt , ##args);		\
+		else __mlog_debug(fmt , ##args);			\
 	}								\
 } while (0)
 
+#define mlog(mask, fmt, args...) do {					\
+	if (__mlog_key_test(MLOG_MASK_PREFIX | (mask)))			\
+		__mlog(mask, fmt , ##args);				\
+} while (0)
+
 #define mlog_errno(st) do {						\
 	if ((st) != -ERESTARTSYS && (st) != -EINTR)			\
 		mlog(ML_ERROR, "status = %lld\n", (long long)(st));	\
@@ -190,22 +261,24 @@ extern struct mlog_bits mlog_and_bits, mlog_not_bits;
 #if (__GNUC__ > 3 || (__GNUC__ == 3 && __GNUC_MINOR__ >= 1)) && \
     !defined(__CHECKER__)
 #define mlog_exit(st) do {						     \
+	if (!__mlog_key_test(MLOG_MASK_PREFIX | ML_EXIT))		     \
+		break;							     \
 	if (__builtin_types_compatible_p(typeof(st), unsigned long))	     \
-		mlog(ML_EXIT, "EXIT: %lu\n", (unsigned long) (st));	     \
+		__mlog(ML_EXIT, "EXIT: %lu\n", (unsigned long) (st));	     \
 	else if (__builtin_types_compatible_p(typeof(st), signed long))      \
-		mlog(ML_EXIT, "EXIT: %ld\n", (signed long) (st));	     \
+		__mlog(ML_EXIT, "EXIT: %ld\n", (signed long) (st));	     \
 	else if (__builtin_types_compatible_p(typeof(st), unsigned int)	     \
 		 || __builtin_types_compatible_p(typeof(st), unsigned short) \
 		 || __builtin_types_compatible_p(typeof(st), unsigned char)) \
-		mlog(ML_EXIT, "EXIT: %u\n", (unsigned int) (st));	     \
+		__mlog(ML_EXIT, "EXIT: %u\n", (unsigned int) (st));	     \
 	else if (__builtin_types_compatible_p(typeof(st), signed int)	     \
 		 || __builtin_types_compatible_p(typeof(st), signed short)   \
 		 || __builtin_types_compatible_p(typeof(st), signed char))   \
-		mlog(ML_EXIT, "EXIT: %d\n", (signed int) (st));		     \
+		__mlog(ML_EXIT, "EXIT: %d\n", (signed int) (st));	     \
 	else if (__builtin_types_compatible_p(typeof(st), long long))	     \
-		mlog(ML_EXIT, "EXIT: %lld\n", (long long) (st));	     \
+		__mlog(ML_EXIT, "EXIT: %lld\n", (long long) (st));	     \
 	else								     \
-		mlog(ML_EXIT, "EXIT: %llu\n", (unsigned long long) (st));    \
+		__mlog(ML_EXIT, "EXIT: %llu\n", (unsigned long long) (st));  \
 } while (0)
 #else
 #define mlog_exit(st) do {						     \
@@ -2,6 +2,8 @@
 #define ASM_REQUEST_H
 
 /* ASM I/O requests */
+struct asm_mirror;
+
 struct asm_request {
 	struct list_head r_list;
 	struct asmfs_file_info *r_file;
@@ -9,10 +11,26 @@ struct asm_request {
 	asm_ioc *r_ioc;				/* User asm_ioc */
 	u16 r_status;				/* status_asm_ioc */
 	int r_error;
+	u32 r_edetail;				/* edetail_asm_ioc */
 	unsigned long r_elapsed;		/* Start time while in-flight, elapsted time once complete */
+	ktime_t r_start;			/* When the bio went out, for read latency */
 	struct bio *r_bio;			/* The I/O */
 	size_t r_count;				/* Total bytes */
 	atomic_t r_bio_count;			/* Atomic count */
+	int r_rw;				/* READ or WRITE */
+	int r_throttled;			/* Counted against the limits */
+	struct list_head r_held;		/* Hook into f_held while throttled */
+	int r_orphan;				/* Cancelled while on the device */
+	unsigned long r_deadline;		/* In jiffies, or 0 */
+	int r_expired;				/* On f_complete past r_deadline */
+	struct asm_mirror *r_mirror;		/* Other copies, until finished */
+	int r_op;				/* When the bio doesn't say, else ASM_NOOP */
+	sector_t r_sector;			/* Discard, zeroing and flush only */
+	size_t r_left;				/* ...bytes of the range still to go */
+	struct work_struct r_work;		/* ...which run from here, as do integrity completions */
+	mempool_t *r_pool;			/* Where to free us, or NULL */
+	struct kiocb *r_iocb;			/* aio submitter, or NULL */
+	struct asm_soft_pi *r_pi;		/* Software integrity, reads only */
 };
 
 #endif